@@ -0,0 +1,284 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+// g++ -std=c++17 -O3 -o Word-Count-gen Word-Count-gen.cpp -pthread
+
+// Synthetic corpus generator for the word-count programs: the words follow
+// a Zipf law over a fixed vocabulary, the number of words per line follows
+// the chosen distribution and the files can have skewed sizes. The output
+// depends only on the arguments and the seed, not on the number of threads:
+// every file is made of SEGMENT_BYTES segments, each one generated from its
+// own random stream and written in order.
+
+const uint64_t SEGMENT_BYTES = 16 << 20;
+
+// splitmix64, the same sequence on every platform (unlike <random> distributions)
+struct Random {
+    uint64_t state;
+
+    explicit Random(uint64_t seed):state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+};
+
+// Vose's alias table: O(1) sampling of the Zipf ranks
+struct Zipf {
+    std::vector<double> prob;
+    std::vector<uint32_t> alias;
+
+    Zipf(size_t n, double s):prob(n), alias(n) {
+        std::vector<double> p(n);
+        double sum = 0;
+        for (size_t r = 0; r < n; ++r) sum += p[r] = 1.0 / std::pow(r + 1.0, s);
+        std::vector<uint32_t> small, large;
+        for (size_t r = 0; r < n; ++r) {
+            p[r] = p[r] * n / sum;
+            (p[r] < 1.0 ? small : large).push_back(r);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t l = small.back(), g = large.back();
+            small.pop_back();
+            prob[l] = p[l];
+            alias[l] = g;
+            p[g] -= 1.0 - p[l];
+            if (p[g] < 1.0) {
+                large.pop_back();
+                small.push_back(g);
+            }
+        }
+        for (auto r : large) prob[r] = 1.0;
+        for (auto r : small) prob[r] = 1.0;
+    }
+
+    uint32_t sample(Random& rng) const {
+        double u = rng.uniform() * prob.size();
+        uint32_t r = static_cast<uint32_t>(u);
+        return (u - r < prob[r]) ? r : alias[r];
+    }
+};
+
+// words per line
+struct LineLength {
+    enum Kind { FIXED, UNIFORM, GEOMETRIC } kind;
+    double mean;
+
+    uint32_t sample(Random& rng) const {
+        switch (kind) {
+        case FIXED: return std::max(1.0, mean);
+        case UNIFORM: return 1 + static_cast<uint32_t>(rng.uniform() * (2 * mean - 1));
+        default:
+            // 1 + geometric with the requested mean
+            double q = 1.0 - 1.0 / mean;
+            if (q <= 0) return 1;
+            return 1 + static_cast<uint32_t>(std::log(1.0 - rng.uniform()) / std::log(q));
+        }
+    }
+};
+
+// the vocabulary: rank r is spelled in bijective base 26, so the frequent
+// words are the short ones, over an alphabet shuffled by the seed
+std::vector<std::string> make_vocabulary(size_t n, uint64_t seed) {
+    char letters[26];
+    for (int i = 0; i < 26; ++i) letters[i] = 'a' + i;
+    Random rng(seed ^ 0x766F636162ULL);
+    for (int i = 25; i > 0; --i) std::swap(letters[i], letters[rng.next() % (i + 1)]);
+
+    std::vector<std::string> words(n);
+    for (size_t r = 0; r < n; ++r) {
+        std::string w;
+        for (uint64_t v = r + 1; v > 0; v = (v - 1) / 26) w.push_back(letters[(v - 1) % 26]);
+        words[r] = std::move(w);
+    }
+    return words;
+}
+
+uint64_t mix(uint64_t a, uint64_t b) {
+    Random rng(a * 0xD6E8FEB86659FD93ULL ^ b);
+    return rng.next();
+}
+
+// parses 100, 64K, 10M, 2G...
+bool parse_size(const char* s, uint64_t& bytes) {
+    char* end;
+    double v = std::strtod(s, &end);
+    uint64_t unit = 1;
+    if (*end == 'K' || *end == 'k') unit = 1ULL << 10, ++end;
+    else if (*end == 'M' || *end == 'm') unit = 1ULL << 20, ++end;
+    else if (*end == 'G' || *end == 'g') unit = 1ULL << 30, ++end;
+    if (end == s || *end != '\0' || v <= 0) return false;
+    bytes = static_cast<uint64_t>(v * unit);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    auto usage_and_exit = [argv]() {
+        std::printf("use: %s [--size bytes] [--files n] [--skew s] [--vocab n] [--zipf s] [--line mean] [--line-dist d] [--seed n] [--threads n] outdir\n", argv[0]);
+        std::printf("     --size is the total size, with an optional K, M or G suffix, its default value is 100M\n");
+        std::printf("     --files is the number of files, its default value is 1\n");
+        std::printf("     --skew makes file i proportional to 1/(i+1)^s, its default value is 0 (same size)\n");
+        std::printf("     --vocab is the number of distinct words, its default value is 100000\n");
+        std::printf("     --zipf is the exponent of the word frequencies, its default value is 1.0\n");
+        std::printf("     --line is the mean number of words per line, its default value is 10\n");
+        std::printf("     --line-dist is fixed, uniform or geometric, its default value is geometric\n");
+        std::printf("     --seed selects the corpus, its default value is 1\n");
+        std::printf("     --threads is the number of threads, its default value is the number of cores\n");
+        std::printf("     outdir receives part-NNNN.txt and filelist.txt, to be used with the word counters\n\n");
+        exit(-1);
+    };
+
+    uint64_t total = 100 << 20;
+    size_t nfiles = 1;
+    double skew = 0;
+    size_t vocab = 100000;
+    double zipf_s = 1.0;
+    LineLength line{LineLength::GEOMETRIC, 10};
+    uint64_t seed = 1;
+    int nth = std::max(1u, std::thread::hardware_concurrency());
+
+    int i = 1;
+    try {
+        for (; i + 1 < argc && std::strncmp(argv[i], "--", 2) == 0; i += 2) {
+            const std::string opt = argv[i];
+            const char* value = argv[i + 1];
+            if (opt == "--size") {
+                if (!parse_size(value, total)) throw std::invalid_argument("size");
+            } else if (opt == "--files") nfiles = std::stoul(value);
+            else if (opt == "--skew") skew = std::stod(value);
+            else if (opt == "--vocab") vocab = std::stoul(value);
+            else if (opt == "--zipf") zipf_s = std::stod(value);
+            else if (opt == "--line") line.mean = std::stod(value);
+            else if (opt == "--line-dist") {
+                const std::string d = value;
+                if (d == "fixed") line.kind = LineLength::FIXED;
+                else if (d == "uniform") line.kind = LineLength::UNIFORM;
+                else if (d == "geometric") line.kind = LineLength::GEOMETRIC;
+                else throw std::invalid_argument("line-dist");
+            } else if (opt == "--seed") seed = std::stoull(value);
+            else if (opt == "--threads") nth = std::stoi(value);
+            else usage_and_exit();
+        }
+    } catch (std::exception const& ex) {
+        std::printf("%s is an invalid value (%s)\n", argv[i + 1], ex.what());
+        return -1;
+    }
+    if (i + 1 != argc) usage_and_exit();
+    if (nfiles == 0 || vocab == 0 || vocab > UINT32_MAX || line.mean < 1 || nth <= 0 || skew < 0 || zipf_s < 0) {
+        std::printf("files, vocab, threads and line must be positive, skew and zipf not negative\n");
+        return -1;
+    }
+    const std::string outdir = argv[i];
+    std::filesystem::create_directories(outdir);
+
+    auto start = std::chrono::steady_clock::now();
+
+    // size of every file, then the segments in file order
+    std::vector<uint64_t> sizes(nfiles);
+    double wsum = 0;
+    for (size_t f = 0; f < nfiles; ++f) wsum += 1.0 / std::pow(f + 1.0, skew);
+    for (size_t f = 0; f < nfiles; ++f)
+        sizes[f] = std::max<uint64_t>(1, total / wsum / std::pow(f + 1.0, skew));
+
+    struct Segment { size_t file; uint64_t index; uint64_t bytes; bool last; };
+    std::vector<Segment> segments;
+    std::vector<std::string> names(nfiles);
+    for (size_t f = 0; f < nfiles; ++f) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "part-%04zu.txt", f);
+        names[f] = (std::filesystem::path(outdir) / name).string();
+        for (uint64_t off = 0, k = 0; off < sizes[f]; off += SEGMENT_BYTES, ++k)
+            segments.push_back({f, k, std::min(SEGMENT_BYTES, sizes[f] - off), off + SEGMENT_BYTES >= sizes[f]});
+    }
+
+    const auto words = make_vocabulary(vocab, seed);
+    const Zipf zipf(vocab, zipf_s);
+
+    // the threads generate the segments in parallel, a segment is written
+    // once all the previous ones have been; so only the current file is
+    // open, from its first segment to its last one
+    std::atomic<size_t> next{0};
+    size_t written = 0;
+    int fd = -1;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<uint64_t> tokens{0}, bytes{0};
+    bool failed = false;
+
+    auto generate = [&]() {
+        std::string buffer;
+        for (size_t k; (k = next.fetch_add(1)) < segments.size();) {
+            const Segment& seg = segments[k];
+            Random rng(mix(mix(seed, seg.file), seg.index));
+            buffer.clear();
+            buffer.reserve(seg.bytes + 4096);
+            uint64_t n = 0;
+            // whole lines, the last one may exceed the segment size
+            while (buffer.size() < seg.bytes) {
+                for (uint32_t w = line.sample(rng); w > 0; --w) {
+                    buffer += words[zipf.sample(rng)];
+                    buffer += (w > 1) ? ' ' : '\n';
+                    ++n;
+                }
+            }
+            tokens += n;
+            bytes += buffer.size();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return written == k; });
+            if (seg.index == 0 && !failed) {
+                fd = ::open(names[seg.file].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    std::printf("ERROR: creating file %s\n", names[seg.file].c_str());
+                    failed = true;
+                }
+            }
+            for (size_t done = 0; done < buffer.size() && !failed;) {
+                ssize_t w = ::write(fd, buffer.data() + done, buffer.size() - done);
+                if (w <= 0) failed = true;
+                else done += w;
+            }
+            if (seg.last && fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+            ++written;
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nth; ++t) threads.emplace_back(generate);
+    for (auto& t : threads) t.join();
+    if (fd >= 0) ::close(fd);
+    if (failed) {
+        std::printf("ERROR: writing to %s\n", outdir.c_str());
+        return -1;
+    }
+
+    std::ofstream list(std::filesystem::path(outdir) / "filelist.txt");
+    for (const auto& name : names) list << name << "\n";
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("Generated %zu files, %lu bytes, %lu words (%zu distinct at most)\n", nfiles, bytes.load(), tokens.load(), vocab);
+    std::printf("Generation time (s) %f, %.1f MB/s\n", secs, bytes / 1e6 / secs);
+}
@@ -0,0 +1,214 @@
+#ifndef AUTOTUNE_HPP
+#define AUTOTUNE_HPP
+
+//
+// Auto-tuner for the word-count backends (--autotune).
+//
+// The backend is timed on a sample of the input (its first eighth, between
+// 1 and 16 MB) with one knob changed at a time: first the number of
+// workers, then the chunk size (unless --adaptive sizes the chunks), then,
+// for FastFlow, on-demand versus round-robin scheduling and blocking versus
+// spinning queues. The best configuration is cached per machine in a text file
+// ($WC_AUTOTUNE_CACHE, or ~/.wc-autotune), one line per
+//
+//   host ncpus program corpus-key workers chunk_size ondemand blocking
+//
+// where the corpus key buckets (powers of two) the input size, the number
+// of files, the average line length and the extra work per line, so runs on
+// similar corpora reuse the choice without calibrating again. The options
+// that change the cost of a chunk are part of the key too: --ngram, the
+// --segments size, the --adaptive target and, for compressed inputs, the
+// number of --inflaters.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <unistd.h>
+#include <wordcount.hpp>
+
+namespace autotune {
+
+struct Config {
+	int workers{1};
+	int chunk_size{100};
+	bool ondemand{true};
+	bool blocking{true};
+};
+
+// the knobs a program lets the tuner change
+struct Space {
+	int max_workers;            // usually the cores left to the workers
+	bool chunk_size;            // false with --adaptive
+	bool policies;              // scheduling and blocking mode (FastFlow)
+};
+
+using Backend = std::function<bool(const wc::Input&, int, wc::Counts&)>;
+
+constexpr uint64_t MIN_SAMPLE = 1 << 20;
+constexpr uint64_t MAX_SAMPLE = 16 << 20;
+
+inline std::string cache_file() {
+	if (const char* f = std::getenv("WC_AUTOTUNE_CACHE"))
+		return f;
+	const char* home = std::getenv("HOME");
+	return std::string(home ? home : ".") + "/.wc-autotune";
+}
+
+inline std::string machine() {
+	char host[256] = "unknown";
+	::gethostname(host, sizeof(host) - 1);
+	return std::string(host) + " " + std::to_string(std::thread::hardware_concurrency());
+}
+
+// bucketed statistics of the input, the average line length comes from the
+// first megabyte of the first file, followed by the options changing the
+// cost of a chunk (segment_bytes is 0 without --segments)
+inline std::string corpus_key(const std::vector<std::string>& files, uint64_t bytes, const wc::Options& opt,
+                              uint64_t segment_bytes) {
+	uint64_t line = 0;
+	if (!files.empty()) {
+		std::ifstream in(files[0], std::ios::binary);
+		std::vector<char> buffer(1 << 20);
+		in.read(buffer.data(), buffer.size());
+		const auto n = in.gcount();
+		const auto lines = std::count(buffer.begin(), buffer.begin() + n, '\n');
+		line = lines ? n / lines : n;
+	}
+	auto bucket = [](uint64_t v) { return v ? static_cast<int>(std::log2(static_cast<double>(v))) : 0; };
+	std::ostringstream key;
+	key << "b" << bucket(bytes) << "-f" << bucket(files.size()) << "-l" << bucket(line) << "-w" << bucket(opt.extrawork);
+	// 0 when the option is not given, its bucket plus one otherwise
+	auto given = [&](bool on, uint64_t v) { return on ? bucket(v) + 1 : 0; };
+	key << "-n" << opt.ngram << "-s" << given(segment_bytes > 0, segment_bytes >> 20)
+	    << "-a" << given(opt.target_us > 0, static_cast<uint64_t>(opt.target_us));
+	if (decompress::any_compressed(files))
+		key << "-z" << opt.inflaters;
+	return key.str();
+}
+
+inline bool lookup(const std::string& id, Config& c) {
+	std::ifstream in(cache_file());
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.compare(0, id.size() + 1, id + " ") != 0)
+			continue;
+		std::istringstream fields(line.substr(id.size() + 1));
+		if (fields >> c.workers >> c.chunk_size >> c.ondemand >> c.blocking)
+			return true;
+	}
+	return false;
+}
+
+// replaces the line of id, the others are kept
+inline void store(const std::string& id, const Config& c) {
+	std::vector<std::string> kept;
+	{
+		std::ifstream in(cache_file());
+		std::string line;
+		while (std::getline(in, line))
+			if (line.compare(0, id.size() + 1, id + " ") != 0)
+				kept.push_back(line);
+	}
+	std::ofstream out(cache_file(), std::ios::trunc);
+	for (const auto& line : kept)
+		out << line << "\n";
+	out << id << " " << c.workers << " " << c.chunk_size << " " << c.ondemand << " " << c.blocking << "\n";
+}
+
+// the configuration to use for program on these files: from the cache, or
+// calibrated on a sample of the input (and then cached); segment_bytes is the
+// --segments size count applies, if any
+inline Config tune(const std::string& program, const wc::Options& opt, const std::vector<std::string>& files,
+                   const Space& space, const Backend& count, uint64_t segment_bytes = 0) {
+	Config best;
+	best.workers = std::max(1, space.max_workers);
+	best.chunk_size = opt.chunk_size;
+	uint64_t bytes = 0;
+	for (const auto& f : files)
+		bytes += std::filesystem::file_size(f);
+	const std::string id = machine() + " " + program + " " + corpus_key(files, bytes, opt, segment_bytes);
+	if (lookup(id, best)) {
+		std::fprintf(stderr, "Autotune: cached workers %d, chunk_size %d, %s, %s\n", best.workers, best.chunk_size,
+		             best.ondemand ? "on-demand" : "round-robin", best.blocking ? "blocking" : "spinning");
+		return best;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	const uint64_t sample = std::clamp(bytes / 8, MIN_SAMPLE, MAX_SAMPLE);
+
+	// seconds taken by c on the sample, the best of two runs
+	auto measure = [&](const Config& c) {
+		double t = -1;
+		for (int r = 0; r < 2; ++r) {
+			chunker::Controller controller(c.chunk_size, opt.target_us, c.workers);
+			wc::Input in{files, 1, opt.readahead, opt.extrawork, controller, sample, c.ondemand, c.blocking, opt.inflaters};
+			ngram::Vocabulary vocab;
+			in.ngram = opt.ngram;
+			in.vocab = &vocab;
+			wc::Counts counts;
+			auto t0 = std::chrono::steady_clock::now();
+			if (!count(in, c.workers, counts))
+				return -1.0;
+			double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			if (t < 0 || s < t)
+				t = s;
+		}
+		return t;
+	};
+
+	double best_time = measure(best);
+
+	// keeps the candidate when it is at least 3% faster, to stay away from noise
+	auto attempt = [&](Config c) {
+		double t = measure(c);
+		if (t >= 0 && t < best_time * 0.97) {
+			best = c;
+			best_time = t;
+		}
+	};
+
+	std::vector<int> workers;
+	for (int w = 1; w < space.max_workers; w *= 2)
+		workers.push_back(w);
+	for (int w : workers) {
+		Config c = best;
+		c.workers = w;
+		attempt(c);
+	}
+	if (space.chunk_size && opt.target_us == 0) {
+		for (int lines : {100, 1000, 10000, 100000}) {
+			Config c = best;
+			c.chunk_size = lines;
+			if (lines != best.chunk_size)
+				attempt(c);
+		}
+	}
+	if (space.policies) {
+		Config c = best;
+		c.ondemand = !c.ondemand;
+		attempt(c);
+		c = best;
+		c.blocking = !c.blocking;
+		attempt(c);
+	}
+
+	std::fprintf(stderr, "Autotune: workers %d, chunk_size %d, %s, %s (calibrated in %.3f s)\n",
+	             best.workers, best.chunk_size, best.ondemand ? "on-demand" : "round-robin",
+	             best.blocking ? "blocking" : "spinning",
+	             std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	store(id, best);
+	return best;
+}
+
+} // namespace autotune
+
+#endif // AUTOTUNE_HPP
@@ -0,0 +1,139 @@
+#ifndef CHUNKER_HPP
+#define CHUNKER_HPP
+
+//
+// Chunk size controller shared by the task producer and the workers.
+//
+// In fixed mode a chunk is a given number of lines (the historical
+// chunk_size argument). In adaptive mode a chunk is a byte budget: the
+// workers report how long each chunk took, the producer turns the observed
+// cost per byte into the budget that makes a task last about the target
+// duration. The budget only grows while enough tasks are queued to keep the
+// workers busy. Every resize is recorded and can be printed at the end.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+namespace chunker {
+
+class Controller {
+
+public:
+	// fixed chunks of 'lines' lines when target_us is 0, otherwise a byte
+	// budget resized at runtime so that a task lasts about target_us
+	Controller(size_t lines, double target_us = 0, size_t nworkers = 1, size_t initial_bytes = 64 << 10) :
+		adaptive(target_us > 0), lines(lines), nworkers(std::max<size_t>(nworkers, 1)),
+		target_ns(target_us * 1000.0), budget(initial_bytes) {
+		if (adaptive)
+			history.push_back({0.0, budget, 0.0, 0});
+	}
+
+	bool is_adaptive() const { return adaptive; }
+	size_t bytes() const { return budget; }
+
+	// producer: true when the chunk being filled must be sent out
+	bool full(size_t nlines, size_t nbytes) const {
+		return adaptive ? nbytes >= budget : nlines >= lines;
+	}
+
+	// producer: a chunk of nbytes has been sent out
+	void issued(size_t nbytes) {
+		if (!adaptive)
+			return;
+		++issued_tasks;
+		issued_bytes += nbytes;
+		if (issued_tasks % nworkers == 0)
+			adjust();
+	}
+
+	// workers: a chunk of nbytes took the given time
+	void completed(size_t nbytes, std::chrono::steady_clock::duration elapsed) {
+		if (!adaptive)
+			return;
+		done_bytes.fetch_add(nbytes, std::memory_order_relaxed);
+		done_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+		done_tasks.fetch_add(1, std::memory_order_release);
+	}
+
+	// the chunk sizes chosen during the run
+	void print_log(FILE* out = stderr) const {
+		if (!adaptive)
+			return;
+		size_t lo = budget, hi = budget;
+		for (const auto& e : history) {
+			lo = std::min(lo, e.budget);
+			hi = std::max(hi, e.budget);
+		}
+		std::fprintf(out, "Chunk bytes: %zu resizes, final %zu, min %zu, max %zu, avg issued %zu\n",
+		             history.size() - 1, budget, lo, hi, issued_tasks ? static_cast<size_t>(issued_bytes / issued_tasks) : 0);
+		for (const auto& e : history)
+			std::fprintf(out, "  t=%.4fs budget=%zu bytes task=%.1fus queued=%zu\n",
+			             e.time, e.budget, e.task_us, e.queued);
+	}
+
+private:
+	struct Entry {
+		double time;        // seconds since the controller was created
+		size_t budget;
+		double task_us;     // average task duration that triggered the resize
+		size_t queued;      // tasks sent out and not completed yet
+	};
+
+	void adjust() {
+		const uint64_t tasks = done_tasks.load(std::memory_order_acquire);
+		const uint64_t nbytes = done_bytes.load(std::memory_order_relaxed);
+		const uint64_t ns = done_ns.load(std::memory_order_relaxed);
+		if (tasks == seen_tasks || nbytes == seen_bytes)
+			return;
+
+		// cost per byte over the last window, smoothed
+		const double cost = static_cast<double>(ns - seen_ns) / (nbytes - seen_bytes);
+		const double task_us = static_cast<double>(ns - seen_ns) / (tasks - seen_tasks) / 1000.0;
+		ns_per_byte = (ns_per_byte == 0.0) ? cost : 0.75 * ns_per_byte + 0.25 * cost;
+		seen_tasks = tasks;
+		seen_bytes = nbytes;
+		seen_ns = ns;
+		if (ns_per_byte <= 0.0)
+			return;
+
+		const size_t queued = issued_tasks - tasks;
+		size_t wanted = std::clamp(static_cast<size_t>(target_ns / ns_per_byte), MIN_BYTES, MAX_BYTES);
+		// growing while the workers are starving would only idle them longer
+		if (wanted > budget && queued < nworkers)
+			return;
+		// small deviations are noise, resizing on them makes the budget oscillate
+		if (wanted * 4 < budget * 3 || wanted * 4 > budget * 5) {
+			budget = wanted;
+			const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			history.push_back({t, budget, task_us, queued});
+		}
+	}
+
+	static constexpr size_t MIN_BYTES = 1 << 10;
+	static constexpr size_t MAX_BYTES = 64 << 20;
+
+	const bool adaptive{false};
+	const size_t lines{0};
+	const size_t nworkers{1};
+	const double target_ns{0};
+	size_t budget{0};
+
+	// producer side
+	uint64_t issued_tasks{0}, issued_bytes{0};
+	uint64_t seen_tasks{0}, seen_bytes{0}, seen_ns{0};
+	double ns_per_byte{0.0};
+	std::vector<Entry> history;
+	const std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+	// worker side
+	std::atomic<uint64_t> done_tasks{0}, done_bytes{0}, done_ns{0};
+};
+
+} // namespace chunker
+
+#endif // CHUNKER_HPP
@@ -0,0 +1,461 @@
+#ifndef DECOMPRESS_HPP
+#define DECOMPRESS_HPP
+
+//
+// Input stage for compressed corpora: gzip files (compile with -DUSE_ZLIB,
+// link with -lz) and zstd files (-DUSE_ZSTD, -lzstd) are recognized by their
+// magic number and decompressed in memory, plain files are just read.
+//
+// Every file is cut into independent units that a pool of threads decodes
+// in parallel, up to 'depth' units ahead of the consumer:
+//  - plain files: blocks of block_size bytes;
+//  - zstd: groups of whole frames (found without decoding them);
+//  - gzip: groups of BGZF members (bgzip output, whose headers carry the
+//    member size); any other gzip stream is a single unit from the first
+//    member that is not BGZF, inflated sequentially (members included).
+// The decoded blocks are delivered in file order through the same Source
+// interface as prefetch::Reader, so the line splitting does not change.
+// A file is open only while it is planned and then from the start of its
+// first unit to the end of its last one, so the 'depth' window bounds the
+// open files too.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include <prefetch.hpp>
+
+namespace decompress {
+
+enum Format { PLAIN, GZIP, ZSTD };
+
+inline Format detect(const std::string& path) {
+	unsigned char magic[4] = {0};
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return PLAIN;
+	const ssize_t n = ::pread(fd, magic, sizeof(magic), 0);
+	::close(fd);
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return GZIP;
+	if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return ZSTD;
+	return PLAIN;
+}
+
+inline bool any_compressed(const std::vector<std::string>& files) {
+	for (const auto& f : files)
+		if (detect(f) != PLAIN)
+			return true;
+	return false;
+}
+
+class Reader : public prefetch::Source {
+
+public:
+	Reader(const std::vector<std::string>& files, size_t nthreads = 2, size_t depth = 8, size_t block_size = 4 << 20) :
+		names(files), fds(files.size(), -1), pending(files.size(), 0),
+		depth(std::max<size_t>(depth, 1)), block_size(block_size) {
+		for (size_t f = 0; f < files.size(); ++f)
+			plan(f);
+		for (size_t t = 0; t < std::max<size_t>(nthreads, 1); ++t)
+			workers.emplace_back([this]() { work(); });
+	}
+
+	~Reader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto& t : workers)
+			t.join();
+		for (auto fd : fds)
+			if (fd >= 0) ::close(fd);
+	}
+
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+
+	bool next(prefetch::Block& b) override {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (current.capacity() > 0)
+			free_list.push_back(std::move(current));
+		current = {};
+		while (head < units.size()) {
+			Unit& u = *units[head];
+			// one block ahead is needed to know whether this is the last one
+			cv.wait(lock, [&]() { return u.out.size() >= 2 || u.done; });
+			if (!u.out.empty()) {
+				current = std::move(u.out.front());
+				u.out.pop_front();
+				const bool last = u.last && u.done && u.out.empty();
+				u.last_sent = last;
+				cv.notify_all();  // room in the queue of u
+				b = {u.file, current.data(), current.size(), last};
+				return true;
+			}
+			// a file ends with a unit without output: an empty last block
+			// still tells the consumer that the file is over
+			const bool need_last = u.last && !u.last_sent;
+			const size_t file = u.file;
+			++head;
+			cv.notify_all();  // a new unit can be started
+			if (need_last) {
+				b = {file, current.data(), 0, true};
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the buffer is recycled by the next call to next()
+	void release() override {}
+
+private:
+	struct Unit {
+		size_t file;
+		Format format;
+		off_t offset;
+		uint64_t length;
+		bool last;                          // last unit of its file
+		int fd{-1};                         // set when the unit is started
+		std::deque<std::vector<char>> out;  // decoded blocks not consumed yet
+		bool done{false};
+		bool last_sent{false};
+	};
+
+	// decoded blocks a unit can queue before waiting for the consumer
+	static constexpr size_t MAX_QUEUED = 2;
+	// compressed bytes grouped in a unit of zstd frames or BGZF members
+	static constexpr uint64_t UNIT_BYTES = 1 << 20;
+
+	void add(size_t f, Format format, off_t offset, uint64_t length) {
+		++pending[f];
+		std::unique_ptr<Unit> u(new Unit());
+		u->file = f;
+		u->format = format;
+		u->offset = offset;
+		u->length = length;
+		u->last = false;
+		units.push_back(std::move(u));
+	}
+
+	// cuts file f into units
+	void plan(size_t f) {
+		int fd = ::open(names[f].c_str(), O_RDONLY);
+		struct stat sb;
+		const size_t first = units.size();
+		if (fd < 0 || ::fstat(fd, &sb) != 0) {
+			std::printf("ERROR: opening file %s\n", names[f].c_str());
+		} else {
+			const uint64_t size = sb.st_size;
+			switch (detect(names[f])) {
+			case GZIP: plan_gzip(f, fd, size); break;
+			case ZSTD: plan_zstd(f, fd, size); break;
+			default:
+				for (uint64_t off = 0; off < size; off += block_size)
+					add(f, PLAIN, off, std::min<uint64_t>(block_size, size - off));
+			}
+		}
+		if (fd >= 0)
+			::close(fd);
+		if (units.size() == first)
+			add(f, PLAIN, 0, 0);
+		units.back()->last = true;
+	}
+
+	// groups of BGZF members: the extra field 'BC' holds the member size - 1
+	void plan_gzip(size_t f, int fd, uint64_t size) {
+		uint64_t off = 0, start = 0;
+		unsigned char h[18];
+		while (off < size) {
+			if (::pread(fd, h, sizeof(h), off) != sizeof(h) || h[0] != 0x1f || h[1] != 0x8b ||
+			    !(h[3] & 4) || h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0)
+				break;
+			off += (h[16] | (h[17] << 8)) + 1;
+			if (off - start >= UNIT_BYTES) {
+				add(f, GZIP, start, std::min(off, size) - start);
+				start = off;
+			}
+		}
+		if (start < size)
+			add(f, GZIP, start, size - start);
+	}
+
+	// groups of zstd frames, delimited by walking their block headers
+	void plan_zstd(size_t f, int fd, uint64_t size) {
+		uint64_t start = 0;
+#ifdef USE_ZSTD
+		void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			const char* data = static_cast<const char*>(map);
+			uint64_t off = 0;
+			while (off < size) {
+				const size_t n = ZSTD_findFrameCompressedSize(data + off, size - off);
+				if (ZSTD_isError(n))
+					break;
+				off += n;
+				if (off - start >= UNIT_BYTES) {
+					add(f, ZSTD, start, off - start);
+					start = off;
+				}
+			}
+			::munmap(map, size);
+		}
+#else
+		(void)fd;
+#endif
+		if (start < size)
+			add(f, ZSTD, start, size - start);
+	}
+
+	void work() {
+		while (true) {
+			size_t k;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this]() { return stop || claimed == units.size() || claimed < head + depth; });
+				if (stop || claimed == units.size())
+					return;
+				k = claimed++;
+				open(*units[k]);
+			}
+			run(*units[k]);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				units[k]->done = true;
+				close(*units[k]);
+			}
+			cv.notify_all();
+		}
+	}
+
+	// (re)opens the file of u for its first unit, with the lock held
+	void open(Unit& u) {
+		const size_t f = u.file;
+		if (fds[f] < 0 && u.length > 0) {
+			fds[f] = ::open(names[f].c_str(), O_RDONLY);
+			if (fds[f] < 0)
+				std::printf("ERROR: opening file %s\n", names[f].c_str());
+			else
+				::posix_fadvise(fds[f], 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		u.fd = fds[f];
+	}
+
+	// closes the file of u after its last unit, with the lock held
+	void close(const Unit& u) {
+		const size_t f = u.file;
+		if (--pending[f] == 0 && fds[f] >= 0) {
+			::close(fds[f]);
+			fds[f] = -1;
+		}
+	}
+
+	std::vector<char> buffer() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (free_list.empty())
+			return std::vector<char>(block_size);
+		std::vector<char> b = std::move(free_list.back());
+		free_list.pop_back();
+		b.resize(block_size);
+		return b;
+	}
+
+	// queues a decoded block, false when the reader is being destroyed
+	bool push(Unit& u, std::vector<char>&& b, size_t size) {
+		b.resize(size);
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&]() { return stop || u.out.size() < MAX_QUEUED; });
+		if (stop)
+			return false;
+		u.out.push_back(std::move(b));
+		lock.unlock();
+		cv.notify_all();
+		return true;
+	}
+
+	// reads up to n bytes of u at offset pos
+	ssize_t read(const Unit& u, char* data, size_t n, uint64_t pos) {
+		n = std::min<uint64_t>(n, u.length - pos);
+		size_t done = 0;
+		while (u.fd >= 0 && done < n) {
+			ssize_t r = ::pread(u.fd, data + done, n - done, u.offset + pos + done);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return r < 0 ? -1 : done;
+			done += r;
+		}
+		return u.fd >= 0 ? static_cast<ssize_t>(done) : -1;
+	}
+
+	void fail(const Unit& u, const char* what) {
+		std::printf("ERROR: decompressing file %s (%s)\n", names[u.file].c_str(), what);
+	}
+
+	void run(Unit& u) {
+		if (u.format == PLAIN) {
+			if (u.length == 0)
+				return;
+			std::vector<char> b = buffer();
+			ssize_t n = read(u, b.data(), u.length, 0);
+			if (n > 0)
+				push(u, std::move(b), n);
+			return;
+		}
+		if (u.format == GZIP)
+			inflate(u);
+		else
+			unzstd(u);
+	}
+
+	void inflate(Unit& u) {
+#ifdef USE_ZLIB
+		z_stream zs;
+		std::memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, 15 + 16) != Z_OK)
+			return fail(u, "zlib");
+		std::vector<char> in(1 << 20);
+		std::vector<char> out = buffer();
+		uint64_t pos = 0;
+		zs.next_out = reinterpret_cast<Bytef*>(out.data());
+		zs.avail_out = out.size();
+		bool ok = true;
+		bool pending = false;  // a full output buffer may have left data in zlib
+		bool open = false;     // a member was started and its trailer not seen yet
+		while (ok) {
+			if (zs.avail_in == 0 && !pending) {
+				ssize_t n = read(u, in.data(), in.size(), pos);
+				if (n < 0) {
+					fail(u, "read error");
+					ok = false;
+				} else if (n == 0 && open) {
+					fail(u, "unexpected end of the stream");
+					ok = false;
+				}
+				if (n <= 0)
+					break;
+				pos += n;
+				zs.next_in = reinterpret_cast<Bytef*>(in.data());
+				zs.avail_in = n;
+			}
+			int rc = ::inflate(&zs, Z_NO_FLUSH);
+			pending = (zs.avail_out == 0);
+			if (rc == Z_STREAM_END) {
+				// the next member, if any, starts right after this one
+				inflateReset(&zs);
+				open = false;
+			} else if (rc == Z_OK) {
+				open = true;
+			} else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+				fail(u, zs.msg ? zs.msg : "corrupted data");
+				ok = false;
+			}
+			if (zs.avail_out == 0 || !ok) {
+				ok = push(u, std::move(out), out.size() - zs.avail_out) && ok;
+				out = buffer();
+				zs.next_out = reinterpret_cast<Bytef*>(out.data());
+				zs.avail_out = out.size();
+			}
+		}
+		if (ok && zs.avail_out < out.size())
+			push(u, std::move(out), out.size() - zs.avail_out);
+		inflateEnd(&zs);
+#else
+		fail(u, "gzip support needs -DUSE_ZLIB -lz");
+#endif
+	}
+
+	void unzstd(Unit& u) {
+#ifdef USE_ZSTD
+		ZSTD_DStream* zs = ZSTD_createDStream();
+		if (!zs)
+			return fail(u, "zstd");
+		std::vector<char> in(ZSTD_DStreamInSize());
+		std::vector<char> out = buffer();
+		ZSTD_inBuffer input = {in.data(), 0, 0};
+		ZSTD_outBuffer output = {out.data(), out.size(), 0};
+		uint64_t pos = 0;
+		bool ok = true;
+		bool pending = false;  // a full output buffer may have left data in zstd
+		bool open = false;     // a frame was started and not completed yet
+		while (ok) {
+			if (input.pos == input.size && !pending) {
+				ssize_t n = read(u, in.data(), in.size(), pos);
+				if (n < 0) {
+					fail(u, "read error");
+					ok = false;
+				} else if (n == 0 && open) {
+					fail(u, "unexpected end of the stream");
+					ok = false;
+				}
+				if (n <= 0)
+					break;
+				pos += n;
+				input = {in.data(), static_cast<size_t>(n), 0};
+			}
+			// consecutive frames are decoded one after the other
+			size_t rc = ZSTD_decompressStream(zs, &output, &input);
+			pending = (output.pos == output.size);
+			if (ZSTD_isError(rc)) {
+				fail(u, ZSTD_getErrorName(rc));
+				ok = false;
+			} else {
+				// 0 once a frame is complete and fully flushed
+				open = (rc != 0);
+			}
+			if (output.pos == output.size || !ok) {
+				ok = push(u, std::move(out), output.pos) && ok;
+				out = buffer();
+				output = {out.data(), out.size(), 0};
+			}
+		}
+		if (ok && output.pos > 0)
+			push(u, std::move(out), output.pos);
+		ZSTD_freeDStream(zs);
+#else
+		fail(u, "zstd support needs -DUSE_ZSTD -lzstd");
+#endif
+	}
+
+	std::vector<std::string> names;
+	std::vector<int> fds;           // -1 when closed
+	std::vector<size_t> pending;    // units of the file not done yet
+	std::vector<std::unique_ptr<Unit>> units;
+	const size_t depth;
+	const size_t block_size;
+
+	size_t head{0};     // unit being consumed
+	size_t claimed{0};  // units started by the workers
+	bool stop{false};
+	std::vector<char> current;
+	std::vector<std::vector<char>> free_list;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+} // namespace decompress
+
+#endif // DECOMPRESS_HPP
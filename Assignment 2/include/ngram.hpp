@@ -0,0 +1,240 @@
+#ifndef NGRAM_HPP
+#define NGRAM_HPP
+
+//
+// N-gram counting without building a string per n-gram (--ngram N).
+//
+// Tokens are interned once in a Vocabulary shared by all the workers (each
+// worker keeps a private cache of the ids it has already seen), an n-gram
+// is the key made of the 32-bit ids of its tokens: 64 bits up to bigrams,
+// 128 bits up to 4-grams. The key identifies the n-gram exactly, so the
+// table stores only fixed-size (key, count) slots and the surface strings
+// are built only for the n-grams that are reported. N-grams do not cross
+// lines (a chunk always holds whole lines).
+//
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+
+namespace ngram {
+
+constexpr int MAX_N = 4;
+
+struct Key {
+	uint64_t lo{0};
+	uint64_t hi{0};
+
+	bool operator==(const Key& o) const { return lo == o.lo && hi == o.hi; }
+
+	// token i of the n-gram
+	uint32_t id(int i) const { return static_cast<uint32_t>((i < 2 ? lo : hi) >> (32 * (i & 1))); }
+
+	void set(int i, uint32_t id) {
+		uint64_t& w = (i < 2) ? lo : hi;
+		const int shift = 32 * (i & 1);
+		w = (w & ~(0xFFFFFFFFULL << shift)) | (static_cast<uint64_t>(id) << shift);
+	}
+};
+
+inline uint64_t hash(const Key& k) {
+	uint64_t h = k.lo * 0x9E3779B97F4A7C15ULL ^ (k.hi + 0x632BE59BD9B4E019ULL) * 0xC2B2AE3D27D4EB4FULL;
+	return h ^ (h >> 29);
+}
+
+inline uint64_t hash(uint64_t k) {
+	const uint64_t h = k * 0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 29);
+}
+
+// open addressing table with linear probing, a zero count marks a free slot
+template <typename K>
+class Slots {
+
+public:
+	void add(const K& k, uint64_t n = 1) {
+		if ((used + 1) * 2 > slots.size())
+			grow();
+		Slot& s = find(k);
+		if (s.count == 0) {
+			s.key = k;
+			++used;
+		}
+		s.count += n;
+	}
+
+	void merge(const Slots& o) {
+		for (const auto& s : o.slots)
+			if (s.count)
+				add(s.key, s.count);
+	}
+
+	size_t size() const { return used; }
+
+	// calls f(key, count) on every n-gram
+	template <typename F>
+	void for_each(F&& f) const {
+		for (const auto& s : slots)
+			if (s.count)
+				f(s.key, s.count);
+	}
+
+private:
+	struct Slot {
+		K key{};
+		uint64_t count{0};
+	};
+
+	Slot& find(const K& k) {
+		const size_t mask = slots.size() - 1;
+		for (size_t i = hash(k) & mask;; i = (i + 1) & mask)
+			if (slots[i].count == 0 || slots[i].key == k)
+				return slots[i];
+	}
+
+	// allocated at the first add, the table of the other key size stays empty
+	void grow() {
+		std::vector<Slot> old(std::max<size_t>(slots.size() * 2, 1024));
+		old.swap(slots);
+		for (const auto& s : old)
+			if (s.count)
+				find(s.key) = s;
+	}
+
+	std::vector<Slot> slots;
+	size_t used{0};
+};
+
+// the counts of the n-grams: up to bigrams the key is its low word, so the
+// slots take 16 bytes instead of 24
+class Table {
+
+public:
+	void add(const Key& k, int n) {
+		if (n <= 2)
+			narrow.add(k.lo);
+		else
+			wide.add(k);
+	}
+
+	void merge(const Table& o) {
+		narrow.merge(o.narrow);
+		wide.merge(o.wide);
+	}
+
+	size_t size() const { return narrow.size() + wide.size(); }
+
+	uint64_t total() const {
+		uint64_t t = 0;
+		for_each([&](const Key&, uint64_t count) { t += count; });
+		return t;
+	}
+
+	// the k most frequent n-grams in descending order
+	std::vector<std::pair<Key, uint64_t>> top(size_t k) const {
+		std::vector<std::pair<Key, uint64_t>> entries;
+		entries.reserve(size());
+		for_each([&](const Key& key, uint64_t count) { entries.emplace_back(key, count); });
+		k = std::min(k, entries.size());
+		std::partial_sort(entries.begin(), entries.begin() + k, entries.end(),
+		                  [](const auto& a, const auto& b) { return a.second > b.second; });
+		entries.resize(k);
+		return entries;
+	}
+
+private:
+	template <typename F>
+	void for_each(F&& f) const {
+		narrow.for_each([&](uint64_t lo, uint64_t count) { f(Key{lo, 0}, count); });
+		wide.for_each(f);
+	}
+
+	Slots<uint64_t> narrow;
+	Slots<Key> wide;
+};
+
+// token -> id, shared by all the workers; the shards keep the contention
+// low on the first sight of a token, later the workers use their cache.
+// The text of a token is stored once, in words (a deque never moves it),
+// and every map refers to it.
+class Vocabulary {
+
+public:
+	// the id of w and its stored text
+	std::pair<uint32_t, std::string_view> intern(std::string_view w) {
+		Shard& s = shards[std::hash<std::string_view>{}(w) % NSHARDS];
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.ids.find(w);
+		if (it != s.ids.end())
+			return {it->second, it->first};
+		std::lock_guard<std::mutex> lock_words(words_mutex);
+		const uint32_t id = words.size();
+		const std::string_view text = words.emplace_back(w);
+		s.ids.emplace(text, id);
+		return {id, text};
+	}
+
+	// to be used once the counting is over
+	const std::string& word(uint32_t id) const { return words[id]; }
+
+	// the tokens of the n-gram, separated by a blank
+	std::string text(const Key& k, int n) const {
+		std::string s = word(k.id(0));
+		for (int i = 1; i < n; ++i)
+			(s += ' ') += word(k.id(i));
+		return s;
+	}
+
+private:
+	static constexpr size_t NSHARDS = 64;
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<std::string_view, uint32_t> ids;
+	};
+
+	Shard shards[NSHARDS];
+	std::deque<std::string> words;
+	std::mutex words_mutex;
+};
+
+// private cache of a worker over the shared vocabulary, probed with the
+// token in place (its keys are the texts stored in the vocabulary)
+using Cache = std::unordered_map<std::string_view, uint32_t>;
+
+// adds the n-grams of a line to the table, returns the number of tokens
+inline uint64_t count_line(std::string_view line, int n, Table& table, Vocabulary& vocab, Cache& cache) {
+	uint64_t tokens = 0;
+	uint32_t window[MAX_N];
+	size_t p = line.find_first_not_of(" \r\n");
+	while (p != std::string_view::npos) {
+		size_t q = line.find_first_of(" \r\n", p);
+		const std::string_view token = line.substr(p, q == std::string_view::npos ? q : q - p);
+		auto it = cache.find(token);
+		if (it == cache.end()) {
+			const auto [id, text] = vocab.intern(token);
+			it = cache.emplace(text, id).first;
+		}
+		// the window holds the last n ids
+		std::memmove(window, window + 1, (n - 1) * sizeof(uint32_t));
+		window[n - 1] = it->second;
+		if (++tokens >= static_cast<uint64_t>(n)) {
+			Key k;
+			for (int i = 0; i < n; ++i)
+				k.set(i, window[i]);
+			table.add(k, n);
+		}
+		p = (q == std::string_view::npos) ? q : line.find_first_not_of(" \r\n", q);
+	}
+	return tokens;
+}
+
+} // namespace ngram
+
+#endif // NGRAM_HPP
@@ -0,0 +1,472 @@
+#ifndef PREFETCH_HPP
+#define PREFETCH_HPP
+
+//
+// Asynchronous input layer: the files are read in large blocks that are
+// kept in flight ahead of the consumer, so the thread that creates the
+// tasks never blocks on I/O while data is available.
+//
+// Two engines share the same ring of 'depth' rotating buffers:
+//  - io_uring, when compiled with -DUSE_IO_URING (link with -luring) and
+//    supported by the running kernel: up to 'depth' reads are submitted
+//    at once;
+//  - otherwise a dedicated prefetch thread that fills the free buffers
+//    with pread.
+// Blocks are always delivered in file order, so lines crossing two blocks
+// can be stitched back by the consumer (see for_each_line). A file is
+// opened when its first block is planned and closed once its last one is
+// released, so only the files of the blocks in flight are open.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
+
+namespace prefetch {
+
+struct Block {
+	size_t file;        // index in the file list
+	const char* data;
+	size_t size;
+	bool last;          // last block of its file
+};
+
+// anything delivering the blocks of a file list in order (see also
+// decompress.hpp for compressed files)
+class Source {
+
+public:
+	virtual ~Source() = default;
+
+	// waits for the next block in file order, false when all the files have
+	// been read; the block stays valid until release() is called
+	virtual bool next(Block& b) = 0;
+
+	// gives the buffer of the current block back to the source
+	virtual void release() = 0;
+};
+
+class Reader : public Source {
+
+public:
+	// byte range [first, second) to read of every file
+	using Ranges = std::vector<std::pair<uint64_t, uint64_t>>;
+
+	// reads the files whole, or only their 'ranges' when not null
+	Reader(const std::vector<std::string>& files, size_t depth = 4, size_t block_size = 4 << 20,
+	       const Ranges* ranges = nullptr) :
+		files(files), ranges(ranges), block_size(block_size), slots(depth == 0 ? 1 : depth) {
+		for (auto& s : slots)
+			s.buffer.resize(block_size);
+
+#ifdef USE_IO_URING
+		uring = (io_uring_queue_init(slots.size(), &ring, 0) == 0);
+		if (uring)
+			return;
+#endif
+		worker = std::thread([this]() { prefetch_loop(); });
+	}
+
+	~Reader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv.notify_all();
+		if (worker.joinable())
+			worker.join();
+		size_t produced = done;
+#ifdef USE_IO_URING
+		if (uring) {
+			// drain the reads still in flight before releasing the buffers
+			while (inflight > 0) {
+				struct io_uring_cqe* cqe;
+				int ret = io_uring_wait_cqe(&ring, &cqe);
+				if (ret == -EINTR)
+					continue;
+				if (ret < 0)
+					break;
+				io_uring_cqe_seen(&ring, cqe);
+				--inflight;
+			}
+			io_uring_queue_exit(&ring);
+			produced = issued;
+		}
+#endif
+		// the files planned and not released yet
+		for (size_t k = head; k < produced; ++k)
+			if (slots[k % slots.size()].read.last)
+				::close(slots[k % slots.size()].read.fd);
+		if (plan_fd >= 0)
+			::close(plan_fd);
+	}
+
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+
+	bool next(Block& b) override {
+		Slot& s = slots[head % slots.size()];
+#ifdef USE_IO_URING
+		if (uring) {
+			submit();
+			if (head == issued)
+				return false;
+			while (!s.ready)
+				complete();
+		} else
+#endif
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return done > head || finished; });
+			if (done == head)
+				return false;
+		}
+		b = {s.read.file, s.buffer.data(), s.size, s.read.last};
+		return true;
+	}
+
+	void release() override {
+		// every block of a file has been read when its last one is released
+		const Read& r = slots[head % slots.size()].read;
+		if (r.last)
+			::close(r.fd);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++head;
+		}
+		cv.notify_all();
+	}
+
+private:
+	struct Read {
+		size_t file;
+		int fd;
+		off_t offset;
+		size_t length;
+		bool last;      // the fd is closed with this block
+	};
+
+	struct Slot {
+		std::vector<char> buffer;
+		Read read{};
+		size_t size{0};
+		bool ready{false};
+	};
+
+	// the next block to read, false after the last file: the files are
+	// opened (and their blocks planned) only when their turn comes, so at
+	// most one file per buffer, plus one, is open at any time
+	bool plan(Read& r) {
+		while (plan_fd < 0) {
+			if (next_file == files.size())
+				return false;
+			plan_file = next_file++;
+			int fd = ::open(files[plan_file].c_str(), O_RDONLY);
+			struct stat sb;
+			if (fd < 0 || ::fstat(fd, &sb) != 0) {
+				std::printf("ERROR: opening file %s\n", files[plan_file].c_str());
+				if (fd >= 0) ::close(fd);
+				continue;
+			}
+			off_t begin = 0, end = sb.st_size;
+			if (ranges) {
+				begin = std::min<uint64_t>((*ranges)[plan_file].first, end);
+				end = std::min<uint64_t>((*ranges)[plan_file].second, end);
+			}
+			if (end <= begin) {
+				::close(fd);
+				continue;
+			}
+			::posix_fadvise(fd, begin, end - begin, POSIX_FADV_SEQUENTIAL);
+			plan_fd = fd;
+			plan_end = end;
+			plan_offset = begin;
+		}
+		const size_t len = std::min<off_t>(block_size, plan_end - plan_offset);
+		r = {plan_file, plan_fd, plan_offset, len, plan_offset + static_cast<off_t>(len) == plan_end};
+		plan_offset += len;
+		if (r.last)
+			plan_fd = -1;
+		return true;
+	}
+
+	// reads what is missing of the block of s with pread
+	void read_rest(Slot& s) {
+		const Read& r = s.read;
+		while (s.size < r.length) {
+			ssize_t n = ::pread(r.fd, s.buffer.data() + s.size, r.length - s.size, r.offset + s.size);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				failed(r, n < 0 ? errno : 0);
+				break;
+			}
+			s.size += n;
+		}
+	}
+
+	// a block that cannot be read whole: the count misses part of the file
+	void failed(const Read& r, int error) {
+		std::printf("ERROR: reading file %s: %s\n", files[r.file].c_str(),
+					error ? std::strerror(error) : "unexpected end of file");
+	}
+
+	// prefetch thread: fills the buffers released by the consumer
+	void prefetch_loop() {
+		for (size_t k = 0;; ++k) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this, k]() { return stop || k < head + slots.size(); });
+				if (stop)
+					return;
+			}
+			Slot& s = slots[k % slots.size()];
+			if (!plan(s.read)) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					finished = true;
+				}
+				cv.notify_all();
+				return;
+			}
+			s.size = 0;
+			read_rest(s);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				done = k + 1;
+			}
+			cv.notify_all();
+		}
+	}
+
+#ifdef USE_IO_URING
+	// keeps up to one read in flight per free buffer; once the ring has
+	// failed the buffers are filled with pread instead
+	void submit() {
+		bool any = false;
+		while (!planned_all && issued < head + slots.size()) {
+			struct io_uring_sqe* sqe = broken ? nullptr : io_uring_get_sqe(&ring);
+			if (!sqe && !broken)
+				break;
+			Slot& s = slots[issued % slots.size()];
+			if (!plan(s.read)) {
+				planned_all = true;
+				break;
+			}
+			s.size = 0;
+			s.ready = false;
+			if (broken) {
+				read_rest(s);
+				s.ready = true;
+			} else {
+				io_uring_prep_read(sqe, s.read.fd, s.buffer.data(), s.read.length, s.read.offset);
+				io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(issued));
+				++inflight;
+				any = true;
+			}
+			++issued;
+		}
+		if (any)
+			io_uring_submit(&ring);
+	}
+
+	// waits for one completion, a short read is resubmitted for the rest
+	void complete() {
+		struct io_uring_cqe* cqe;
+		int ret;
+		while ((ret = io_uring_wait_cqe(&ring, &cqe)) == -EINTR)
+			;
+		if (ret < 0) {
+			// the completions are lost: the blocks in flight are read again
+			std::printf("ERROR: io_uring: %s, reading with pread\n", std::strerror(-ret));
+			broken = true;
+			for (size_t k = head; k < issued; ++k) {
+				Slot& s = slots[k % slots.size()];
+				if (!s.ready) {
+					s.size = 0;
+					read_rest(s);
+					s.ready = true;
+				}
+			}
+			inflight = 0;
+			return;
+		}
+		size_t k = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		--inflight;
+
+		Slot& s = slots[k % slots.size()];
+		if (s.ready)
+			return;     // read again with pread after a failure
+		const Read& r = s.read;
+		if (res < 0 && res != -EINTR && res != -EAGAIN) {
+			failed(r, -res);
+			s.ready = true;
+			return;
+		}
+		if (res > 0)
+			s.size += res;
+		if (res == 0) {
+			failed(r, 0);
+			s.ready = true;
+			return;
+		}
+		if (s.size == r.length) {
+			s.ready = true;
+			return;
+		}
+		struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+		if (!sqe) {
+			io_uring_submit(&ring);
+			sqe = io_uring_get_sqe(&ring);
+		}
+		if (!sqe) {
+			read_rest(s);
+			s.ready = true;
+			return;
+		}
+		io_uring_prep_read(sqe, r.fd, s.buffer.data() + s.size, r.length - s.size, r.offset + s.size);
+		io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(k));
+		io_uring_submit(&ring);
+		++inflight;
+	}
+
+	bool uring{false};
+	bool broken{false};
+	bool planned_all{false};
+	struct io_uring ring;
+	size_t issued{0};
+	size_t inflight{0};
+#endif
+
+	const std::vector<std::string>& files;
+	const Ranges* ranges;
+	const size_t block_size;
+	std::vector<Slot> slots;
+
+	// the file being planned
+	size_t next_file{0};
+	size_t plan_file{0};
+	int plan_fd{-1};
+	off_t plan_end{0};
+	off_t plan_offset{0};
+
+	size_t head{0};     // next block to be consumed
+	size_t done{0};     // blocks filled by the prefetch thread
+	bool finished{false};   // and no more to fill
+	bool stop{false};
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+// calls f on every line of the block; a line crossing two blocks is
+// accumulated in carry and completed by the next block of the same file
+template <typename F>
+void for_each_line(const Block& b, std::string& carry, F&& f) {
+	const char* p = b.data;
+	const char* end = b.data + b.size;
+	while (p < end) {
+		const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		if (!nl) {
+			carry.append(p, end);
+			break;
+		}
+		if (carry.empty()) {
+			f(std::string_view(p, nl - p));
+		} else {
+			carry.append(p, nl);
+			f(std::string_view(carry));
+			carry.clear();
+		}
+		p = nl + 1;
+	}
+	if (b.last && !carry.empty()) {
+		f(std::string_view(carry));
+		carry.clear();
+	}
+}
+
+// pull-style line splitter over a Source: unlike for_each_line it can stop
+// between any two lines and resume later
+class Lines {
+
+public:
+	explicit Lines(Source& reader) : reader(reader) {}
+
+	// the next line not consumed yet and the index of its file, false at the
+	// end of the input; the view stays valid until pop()
+	bool peek(std::string_view& line, size_t& file) {
+		while (!ready) {
+			if (!valid) {
+				if (!reader.next(block))
+					return false;
+				valid = true;
+				p = block.data;
+			}
+			const char* end = block.data + block.size;
+			if (p < end) {
+				const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+				if (!nl) {
+					carry.append(p, end);
+					p = end;
+					continue;
+				}
+				if (carry.empty()) {
+					current = std::string_view(p, nl - p);
+				} else {
+					carry.append(p, nl);
+					current = carry;
+				}
+				p = nl + 1;
+				ready = true;
+			} else if (block.last && !carry.empty()) {
+				current = carry;
+				ready = true;
+			} else {
+				reader.release();
+				valid = false;
+			}
+		}
+		line = current;
+		file = block.file;
+		return true;
+	}
+
+	// consumes the line returned by peek()
+	void pop() {
+		if (current.data() == carry.data())
+			carry.clear();
+		ready = false;
+	}
+
+private:
+	Source& reader;
+	Block block{};
+	bool valid{false};
+	bool ready{false};
+	const char* p{nullptr};
+	std::string carry;
+	std::string_view current;
+};
+
+} // namespace prefetch
+
+#endif // PREFETCH_HPP
@@ -0,0 +1,164 @@
+#ifndef SEGMENTS_HPP
+#define SEGMENTS_HPP
+
+//
+// Intra-file splitting: the files are cut into segments of about the same
+// size, every cut moved just after the next '\n' so that a segment holds
+// whole lines. Each segment is then read by the task that counts it, with
+// its own preads, so there is no central reader.
+//
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <prefetch.hpp>
+
+namespace segments {
+
+struct Segment {
+	size_t file;        // index in the file list
+	uint64_t offset;
+	uint64_t length;
+};
+
+// the files of a list, each one open only while some of its segments are
+// being read: the first task claiming a segment opens it, the one releasing
+// its last segment closes it
+class Files {
+
+public:
+	explicit Files(const std::vector<std::string>& names) :
+		names(names), sizes(names.size(), 0), fds(names.size(), -1), users(names.size(), 0), pending(names.size(), 0) {
+		for (size_t f = 0; f < names.size(); ++f) {
+			struct stat sb;
+			if (::stat(names[f].c_str(), &sb) != 0) {
+				std::printf("ERROR: opening file %s\n", names[f].c_str());
+				continue;
+			}
+			sizes[f] = sb.st_size;
+		}
+	}
+
+	~Files() {
+		for (auto fd : fds)
+			if (fd >= 0) ::close(fd);
+	}
+
+	Files(const Files&) = delete;
+	Files& operator=(const Files&) = delete;
+
+	// the fd of file f for one of its segments, -1 if it cannot be opened
+	int claim(size_t f) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (users[f]++ == 0 && fds[f] < 0) {
+			fds[f] = ::open(names[f].c_str(), O_RDONLY);
+			if (fds[f] < 0)
+				std::printf("ERROR: opening file %s\n", names[f].c_str());
+			else
+				::posix_fadvise(fds[f], 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		return fds[f];
+	}
+
+	// one more segment of file f to read
+	void planned(size_t f) {
+		++pending[f];
+	}
+
+	// gives back the fd of file f, closed after its last planned segment
+	void release(size_t f) {
+		std::lock_guard<std::mutex> lock(mutex);
+		--users[f];
+		if (--pending[f] == 0 && fds[f] >= 0) {
+			::close(fds[f]);
+			fds[f] = -1;
+		}
+	}
+
+	const std::vector<std::string>& names;
+	std::vector<uint64_t> sizes;
+
+private:
+	std::vector<int> fds;
+	std::vector<size_t> users;      // segments being read
+	std::vector<size_t> pending;    // segments not read yet
+	std::mutex mutex;
+};
+
+// the first offset from 'from' on that starts a line (the file size if none)
+inline uint64_t next_line(int fd, uint64_t from, uint64_t size) {
+	char window[64 << 10];
+	for (uint64_t off = from - 1; off < size;) {
+		ssize_t n = ::pread(fd, window, sizeof(window), off);
+		if (n <= 0)
+			break;
+		if (auto nl = static_cast<const char*>(std::memchr(window, '\n', n)))
+			return off + (nl - window) + 1;
+		off += n;
+	}
+	return size;
+}
+
+// segments of about 'bytes' bytes covering the files, or their first
+// 'limit' bytes when limit is not 0 (calibration samples); a file is open
+// only while its cuts are searched
+inline std::vector<Segment> plan(Files& files, uint64_t bytes, uint64_t limit = 0) {
+	std::vector<Segment> result;
+	uint64_t planned = 0;
+	for (size_t f = 0; f < files.sizes.size() && (limit == 0 || planned < limit); ++f) {
+		const uint64_t size = files.sizes[f];
+		if (size == 0)
+			continue;
+		int fd = ::open(files.names[f].c_str(), O_RDONLY);
+		if (fd < 0) {
+			std::printf("ERROR: opening file %s\n", files.names[f].c_str());
+			continue;
+		}
+		for (uint64_t begin = 0; begin < size && (limit == 0 || planned < limit);) {
+			uint64_t target = begin + bytes;
+			if (limit != 0)
+				target = std::min(target, begin + (limit - planned));
+			const uint64_t end = (target >= size) ? size : next_line(fd, target, size);
+			result.push_back({f, begin, end - begin});
+			files.planned(f);
+			planned += end - begin;
+			begin = end;
+		}
+		::close(fd);
+	}
+	return result;
+}
+
+// calls f on every line of the segment, reading it in blocks of block_size
+template <typename F>
+void for_each_line(Files& files, const Segment& s, F&& f, size_t block_size = 1 << 20) {
+	const int fd = files.claim(s.file);
+	std::vector<char> buffer(std::min<uint64_t>(block_size, s.length));
+	std::string carry;
+	for (uint64_t done = 0; fd >= 0 && done < s.length;) {
+		const size_t len = std::min<uint64_t>(buffer.size(), s.length - done);
+		ssize_t n = ::pread(fd, buffer.data(), len, s.offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			std::printf("ERROR: reading file %s\n", files.names[s.file].c_str());
+			break;
+		}
+		done += n;
+		prefetch::for_each_line({s.file, buffer.data(), static_cast<size_t>(n), done == s.length}, carry, f);
+	}
+	files.release(s.file);
+}
+
+} // namespace segments
+
+#endif // SEGMENTS_HPP
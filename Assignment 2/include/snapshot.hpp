@@ -0,0 +1,567 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+//
+// Persistent word-count snapshot used for incremental re-counting.
+//
+// Binary layout (native endianness, all records are 8-byte aligned PODs so
+// the file is used in place through mmap):
+//
+//   Header | FileRec[nfiles] | WordRec[nwords] | EntryRec[nentries] | chars
+//
+// WordRec is the merged table: the vocabulary sorted by word with the total
+// count of each word. Every FileRec owns the slice [first, first+nentries)
+// of EntryRec, whose 'word' field indexes WordRec. Paths and words live in
+// the trailing character pool.
+//
+// An incremental run reads the stored totals in place and only looks up the
+// words of the changed files (a binary search in the sorted vocabulary); the
+// new snapshot merges the old vocabulary with the new words linearly and
+// carries the tables of the unchanged files by index.
+//
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace snapshot {
+
+using umap = std::unordered_map<std::string, uint64_t>;
+
+constexpr char MAGIC[8] = {'W', 'C', 'S', 'N', 'A', 'P', '\0', '\0'};
+constexpr uint32_t VERSION = 1;
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t nfiles;
+	uint64_t nwords;
+	uint64_t nentries;
+	uint64_t nchars;
+};
+
+struct FileRec {
+	uint64_t path;      // offset in the character pool
+	uint64_t path_len;
+	uint64_t size;
+	int64_t  mtime;     // nanoseconds since the epoch
+	uint64_t hash;      // content hash (see Hasher), 0 if unknown
+	uint64_t first;     // first EntryRec of this file
+	uint64_t nentries;
+};
+
+struct WordRec {
+	uint64_t str;       // offset in the character pool
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t count;     // total over all the files
+};
+
+struct EntryRec {
+	uint32_t word;      // index in the WordRec table
+	uint32_t reserved;
+	uint64_t count;
+};
+
+// identity of an input file
+struct FileStat {
+	std::string path;
+	uint64_t size{0};
+	int64_t mtime{0};
+	uint64_t hash{0};
+};
+
+// false if the file cannot be opened for reading
+inline bool stat_file(const std::string& path, FileStat& st) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	struct stat sb;
+	const bool ok = fd >= 0 && ::fstat(fd, &sb) == 0;
+	if (fd >= 0)
+		::close(fd);
+	if (!ok)
+		return false;
+	st.path = path;
+	st.size = sb.st_size;
+	st.mtime = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+	return true;
+}
+
+// 64-bit content hash, consumes the bytes 8 at a time; fed in pieces of
+// any size, it gets the same value as on the whole content
+class Hasher {
+
+public:
+	void update(const char* data, size_t n) {
+		total += n;
+		if (pending > 0) {
+			const size_t k = std::min(n, 8 - pending);
+			std::memcpy(tail + pending, data, k);
+			pending += k;
+			data += k;
+			n -= k;
+			if (pending < 8)
+				return;
+			add(tail);
+			pending = 0;
+		}
+		for (; n >= 8; data += 8, n -= 8)
+			add(data);
+		std::memcpy(tail, data, n);
+		pending = n;
+	}
+
+	uint64_t finish() {
+		if (pending > 0) {
+			std::memset(tail + pending, 0, 8 - pending);
+			add(tail);
+			pending = 0;
+		}
+		return mix(h, total);
+	}
+
+private:
+	static uint64_t mix(uint64_t h, uint64_t w) {
+		h ^= w;
+		h *= 0x9FB21C651E98DF25ULL;
+		return h ^ (h >> 29);
+	}
+
+	void add(const char* p) {
+		uint64_t w;
+		std::memcpy(&w, p, 8);
+		h = mix(h, w);
+	}
+
+	uint64_t h{0x9E3779B97F4A7C15ULL};
+	uint64_t total{0};
+	char tail[8];
+	size_t pending{0};
+};
+
+// content hash of a file, see Hasher
+inline uint64_t hash_file(const std::string& path) {
+	std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+	std::vector<char> buffer(1 << 20);
+	Hasher hasher;
+	while (file) {
+		file.read(buffer.data(), buffer.size());
+		hasher.update(buffer.data(), file.gcount());
+	}
+	return hasher.finish();
+}
+
+// read-only view of a snapshot file, mapped in memory
+class Snapshot {
+
+public:
+	Snapshot() = default;
+	~Snapshot() { close(); }
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	// returns false if the file does not exist or is not a valid snapshot,
+	// in that case the view stays empty
+	bool open(const std::string& filename) {
+		close();
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat sb;
+		if (::fstat(fd, &sb) != 0 || static_cast<size_t>(sb.st_size) < sizeof(Header)) {
+			::close(fd);
+			return false;
+		}
+		void* p = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		base = static_cast<const char*>(p);
+		length = sb.st_size;
+
+		const Header* h = reinterpret_cast<const Header*>(base);
+		if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+		    h->nfiles > length / sizeof(FileRec) || h->nwords > length / sizeof(WordRec) ||
+		    h->nentries > length / sizeof(EntryRec) || h->nchars > length ||
+		    sizeof(Header) + h->nfiles * sizeof(FileRec) + h->nwords * sizeof(WordRec) +
+		    h->nentries * sizeof(EntryRec) + h->nchars != length) {
+			close();
+			return false;
+		}
+		files = reinterpret_cast<const FileRec*>(base + sizeof(Header));
+		words = reinterpret_cast<const WordRec*>(files + h->nfiles);
+		entries = reinterpret_cast<const EntryRec*>(words + h->nwords);
+		chars = reinterpret_cast<const char*>(entries + h->nentries);
+		if (!valid(*h)) {
+			close();
+			return false;
+		}
+		header = h;
+		return true;
+	}
+
+	void close() {
+		if (base)
+			::munmap(const_cast<char*>(base), length);
+		base = nullptr;
+		header = nullptr;
+		length = 0;
+	}
+
+	size_t nfiles() const { return header ? header->nfiles : 0; }
+	size_t nwords() const { return header ? header->nwords : 0; }
+
+	const FileRec& file(size_t i) const { return files[i]; }
+	std::string_view path(size_t i) const { return {chars + files[i].path, files[i].path_len}; }
+	const EntryRec* entries_begin(size_t i) const { return entries + files[i].first; }
+	const EntryRec* entries_end(size_t i) const { return entries + files[i].first + files[i].nentries; }
+
+	std::string_view word(size_t w) const { return {chars + words[w].str, words[w].len}; }
+	uint64_t total(size_t w) const { return words[w].count; }
+
+	// the index of w in the sorted vocabulary, nwords() if it is not there
+	size_t find(std::string_view w) const {
+		size_t lo = 0, hi = nwords();
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (word(mid) < w)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return (lo < nwords() && word(lo) == w) ? lo : nwords();
+	}
+
+private:
+	// every offset and index read from the file stays inside its table, and
+	// the vocabulary is sorted (find() depends on it)
+	bool valid(const Header& h) const {
+		for (size_t i = 0; i < h.nfiles; ++i) {
+			const FileRec& f = files[i];
+			if (f.path > h.nchars || f.path_len > h.nchars - f.path ||
+			    f.first > h.nentries || f.nentries > h.nentries - f.first)
+				return false;
+		}
+		for (size_t w = 0; w < h.nwords; ++w) {
+			if (words[w].str > h.nchars || words[w].len > h.nchars - words[w].str)
+				return false;
+			if (w > 0 && !(std::string_view(chars + words[w - 1].str, words[w - 1].len) <
+			               std::string_view(chars + words[w].str, words[w].len)))
+				return false;
+		}
+		for (size_t e = 0; e < h.nentries; ++e)
+			if (entries[e].word >= h.nwords)
+				return false;
+		return true;
+	}
+
+	const char* base{nullptr};
+	size_t length{0};
+	const Header* header{nullptr};
+	const FileRec* files{nullptr};
+	const WordRec* words{nullptr};
+	const EntryRec* entries{nullptr};
+	const char* chars{nullptr};
+};
+
+// the table of a file in the snapshot being written, its entries index the
+// merged vocabulary
+struct Table {
+	FileStat st;
+	std::vector<EntryRec> entries;
+};
+
+// merges the sorted vocabulary of a with the sorted words b in one pass;
+// index_a and index_b get the position of each word in the result
+inline std::vector<std::string_view> merge_words(const Snapshot& a, const std::vector<std::string_view>& b,
+                                                 std::vector<uint32_t>& index_a, std::vector<uint32_t>& index_b) {
+	std::vector<std::string_view> merged;
+	merged.reserve(a.nwords() + b.size());
+	index_a.resize(a.nwords());
+	index_b.resize(b.size());
+	size_t i = 0, j = 0;
+	while (i < a.nwords() || j < b.size()) {
+		const bool take_a = (j == b.size()) || (i < a.nwords() && a.word(i) <= b[j]);
+		const bool take_b = (i == a.nwords()) || (j < b.size() && b[j] <= a.word(i));
+		if (take_a)
+			index_a[i] = merged.size();
+		if (take_b)
+			index_b[j] = merged.size();
+		merged.push_back(take_a ? a.word(i) : b[j]);
+		i += take_a;
+		j += take_b;
+	}
+	return merged;
+}
+
+// the table of file i of s, with its words moved to the merged vocabulary
+inline Table carry(const FileStat& st, const Snapshot& s, size_t i, const std::vector<uint32_t>& index) {
+	Table t{st, {}};
+	t.entries.reserve(s.file(i).nentries);
+	for (auto e = s.entries_begin(i); e != s.entries_end(i); ++e)
+		t.entries.push_back({index[e->word], 0, e->count});
+	return t;
+}
+
+// writes the snapshot of the given files over the sorted vocabulary; the
+// totals are summed from the tables and the words left without a count are
+// dropped. The file is written aside and then renamed, so a snapshot mapped
+// by a reader stays valid
+inline bool write(const std::string& filename, const std::vector<std::string_view>& vocabulary, std::vector<Table>& files) {
+	std::vector<uint64_t> sum(vocabulary.size(), 0);
+	for (const auto& f : files)
+		for (const auto& e : f.entries)
+			sum[e.word] += e.count;
+	std::vector<uint32_t> rank(vocabulary.size(), UINT32_MAX);
+	uint32_t nwords = 0;
+	for (size_t w = 0; w < vocabulary.size(); ++w)
+		if (sum[w] > 0)
+			rank[w] = nwords++;
+
+	Header h{};
+	std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.nfiles = files.size();
+	h.nwords = nwords;
+
+	std::string pool;
+	std::vector<FileRec> frecs;
+	std::vector<EntryRec> erecs;
+	for (const auto& f : files) {
+		FileRec r{pool.size(), f.st.path.size(), f.st.size, f.st.mtime, f.st.hash, erecs.size(), 0};
+		pool += f.st.path;
+		for (const auto& e : f.entries)
+			if (e.count > 0)
+				erecs.push_back({rank[e.word], 0, e.count});
+		r.nentries = erecs.size() - r.first;
+		frecs.push_back(r);
+	}
+	std::vector<WordRec> wrecs;
+	wrecs.reserve(nwords);
+	for (size_t w = 0; w < vocabulary.size(); ++w) {
+		if (sum[w] == 0)
+			continue;
+		wrecs.push_back({pool.size(), static_cast<uint32_t>(vocabulary[w].size()), 0, sum[w]});
+		pool += vocabulary[w];
+	}
+	h.nentries = erecs.size();
+	h.nchars = pool.size();
+
+	const std::string tmp = filename + ".tmp";
+	std::ofstream out(tmp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	if (!out.is_open())
+		return false;
+	out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	out.write(reinterpret_cast<const char*>(frecs.data()), frecs.size() * sizeof(FileRec));
+	out.write(reinterpret_cast<const char*>(wrecs.data()), wrecs.size() * sizeof(WordRec));
+	out.write(reinterpret_cast<const char*>(erecs.data()), erecs.size() * sizeof(EntryRec));
+	out.write(pool.data(), pool.size());
+	out.close();
+	if (!out)
+		return false;
+	return std::rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+// comparison between the current file list and a previous snapshot
+struct Plan {
+	std::vector<FileStat> stats;     // one per listed file
+	std::vector<ssize_t> previous;   // its index in the snapshot, -1 if new
+	std::vector<size_t> changed;     // listed files that must be (re)counted
+	std::vector<size_t> removed;     // snapshot files that are no longer listed
+	bool stale{false};               // order or mtimes differ from the snapshot
+
+	// the snapshot already describes the listed files
+	bool empty() const { return changed.empty() && removed.empty() && !stale; }
+};
+
+// a file is reused when path, size and mtime match; when only the mtime
+// differs the content hash decides, so touching a file costs one read
+// but no tokenization; false (with an error) if a listed file cannot be read
+inline bool make_plan(const std::vector<std::string>& filenames, const Snapshot& old, Plan& plan) {
+	plan = Plan();
+	std::unordered_map<std::string_view, std::vector<size_t>> byPath;
+	for (size_t i = old.nfiles(); i-- > 0;)
+		byPath[old.path(i)].push_back(i);
+	std::vector<bool> used(old.nfiles(), false);
+
+	for (size_t i = 0; i < filenames.size(); ++i) {
+		FileStat st;
+		if (!stat_file(filenames[i], st)) {
+			std::printf("ERROR: opening file %s\n", filenames[i].c_str());
+			return false;
+		}
+		ssize_t prev = -1;
+		auto it = byPath.find(filenames[i]);
+		if (it != byPath.end() && !it->second.empty()) {
+			prev = it->second.back();
+			it->second.pop_back();
+			used[prev] = true;
+		}
+
+		// the hash of a file to count is taken on the bytes the tokenizer
+		// reads (see Run), it is read here only to tell a touch from a change
+		bool reuse = false;
+		if (prev >= 0 && old.file(prev).size == st.size) {
+			if (old.file(prev).mtime == st.mtime) {
+				st.hash = old.file(prev).hash;
+				reuse = true;
+			} else if (old.file(prev).hash != 0) {
+				st.hash = hash_file(st.path);
+				reuse = (st.hash == old.file(prev).hash);
+			}
+		}
+
+		if (!reuse)
+			plan.changed.push_back(i);
+		else if (prev != static_cast<ssize_t>(i) || old.file(prev).mtime != st.mtime)
+			plan.stale = true;
+		plan.stats.push_back(std::move(st));
+		plan.previous.push_back(prev);
+	}
+
+	for (size_t i = 0; i < old.nfiles(); ++i)
+		if (!used[i])
+			plan.removed.push_back(i);
+	return true;
+}
+
+// the totals of the current run: the stored table of the previous run,
+// read in place, corrected by the deltas of the changed and removed files
+class Totals {
+
+public:
+	// counted[k] is the fresh table of file plan.changed[k], it must outlive
+	// the totals
+	Totals(const Snapshot& old, const Plan& plan, const std::vector<umap>& counted) : old(old) {
+		std::unordered_map<uint32_t, int64_t> changes;
+		auto subtract = [&](size_t i) {
+			for (auto e = old.entries_begin(i); e != old.entries_end(i); ++e)
+				changes[e->word] -= static_cast<int64_t>(e->count);
+		};
+		for (auto r : plan.removed)
+			subtract(r);
+		for (size_t k = 0; k < plan.changed.size(); ++k) {
+			auto prev = plan.previous[plan.changed[k]];
+			if (prev >= 0)
+				subtract(prev);
+			for (const auto& entry : counted[k]) {
+				const size_t w = old.find(entry.first);
+				if (w < old.nwords())
+					changes[w] += static_cast<int64_t>(entry.second);
+				else
+					added[entry.first] += entry.second;
+			}
+		}
+		// sorted, to be walked along with the stored table
+		delta.assign(changes.begin(), changes.end());
+		std::sort(delta.begin(), delta.end());
+	}
+
+	// calls f(word, count) on every word with a count
+	template <typename F>
+	void for_each(F&& f) const {
+		auto d = delta.begin();
+		for (size_t w = 0; w < old.nwords(); ++w) {
+			int64_t count = old.total(w);
+			if (d != delta.end() && d->first == w)
+				count += (d++)->second;
+			if (count > 0)
+				f(old.word(w), static_cast<uint64_t>(count));
+		}
+		for (const auto& entry : added)
+			f(std::string_view(entry.first), entry.second);
+	}
+
+	// the words that are not in the previous snapshot, sorted
+	std::vector<std::string_view> new_words() const {
+		std::vector<std::string_view> result;
+		result.reserve(added.size());
+		for (const auto& entry : added)
+			result.push_back(entry.first);
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+private:
+	const Snapshot& old;
+	std::vector<std::pair<uint32_t, int64_t>> delta;      // stored words whose total changes
+	std::unordered_map<std::string_view, uint64_t> added;  // views of the keys of counted
+};
+
+inline Totals apply_plan(const Snapshot& old, const Plan& plan, const std::vector<umap>& counted) {
+	return Totals(old, plan, counted);
+}
+
+// writes the snapshot of the current run, unless nothing changed
+inline bool save(const std::string& filename, const Snapshot& old, const Plan& plan,
+                 const std::vector<umap>& counted, const Totals& totals) {
+	if (plan.empty())
+		return true;
+
+	const std::vector<std::string_view> fresh = totals.new_words();
+	std::vector<uint32_t> index_old, index_new;
+	const auto vocabulary = merge_words(old, fresh, index_old, index_new);
+
+	std::vector<Table> files;
+	files.reserve(plan.stats.size());
+	size_t k = 0;
+	for (size_t i = 0; i < plan.stats.size(); ++i) {
+		if (k < plan.changed.size() && plan.changed[k] == i) {
+			Table t{plan.stats[i], {}};
+			t.entries.reserve(counted[k].size());
+			for (const auto& entry : counted[k]) {
+				const size_t w = old.find(entry.first);
+				const uint32_t u = (w < old.nwords()) ? index_old[w] :
+				                   index_new[std::lower_bound(fresh.begin(), fresh.end(), entry.first) - fresh.begin()];
+				t.entries.push_back({u, 0, entry.second});
+			}
+			files.push_back(std::move(t));
+			++k;
+		} else {
+			files.push_back(carry(plan.stats[i], old, plan.previous[i], index_old));
+		}
+	}
+	return write(filename, vocabulary, files);
+}
+
+// merges two snapshots: files of b replace the files of a with the same
+// path; the sorted vocabularies are merged linearly and the merged table
+// is recomputed from the per-file tables
+inline bool merge(const Snapshot& a, const Snapshot& b, const std::string& filename) {
+	std::unordered_map<std::string_view, bool> inB;
+	for (size_t i = 0; i < b.nfiles(); ++i)
+		inB[b.path(i)] = true;
+
+	std::vector<std::string_view> words_b(b.nwords());
+	for (size_t w = 0; w < b.nwords(); ++w)
+		words_b[w] = b.word(w);
+	std::vector<uint32_t> index_a, index_b;
+	const auto vocabulary = merge_words(a, words_b, index_a, index_b);
+
+	std::vector<Table> files;
+	auto add = [&files](const Snapshot& s, size_t i, const std::vector<uint32_t>& index) {
+		const FileRec& r = s.file(i);
+		files.push_back(carry({std::string(s.path(i)), r.size, r.mtime, r.hash}, s, i, index));
+	};
+	for (size_t i = 0; i < a.nfiles(); ++i)
+		if (!inB.count(a.path(i)))
+			add(a, i, index_a);
+	for (size_t i = 0; i < b.nfiles(); ++i)
+		add(b, i, index_b);
+	return write(filename, vocabulary, files);
+}
+
+} // namespace snapshot
+
+#endif // SNAPSHOT_HPP
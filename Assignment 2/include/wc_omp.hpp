@@ -0,0 +1,72 @@
+#ifndef WC_OMP_HPP
+#define WC_OMP_HPP
+
+//
+// OpenMP backend: one thread splits the input and creates a task per chunk,
+// every thread counts into its own tables, merged in a critical section.
+// With in.segment_bytes the files are cut into segments instead, and every
+// task reads its own segment (see segments.hpp); compressed files always go
+// through the splitter.
+//
+
+#include <omp.h>
+#include <wordcount.hpp>
+#include <segments.hpp>
+
+namespace wc {
+
+inline bool count_omp(const Input& in, int nth, Counts& counts) {
+	reset(counts, in);
+
+	// define local maps for each thread (one per file slot)
+	static Counts* local;
+	#pragma omp threadprivate(local)
+
+	#pragma omp parallel num_threads(nth)
+	{
+		local = new Counts;
+		reset(*local, in);
+
+		// A single thread creates the tasks
+		#pragma omp single
+		if (in.segment_bytes > 0 && !decompress::any_compressed(in.files)) {
+			segments::Files files(in.files);
+			const auto plan = segments::plan(files, in.segment_bytes, in.limit);
+			#pragma omp taskloop grainsize(1) shared(files, plan)
+			for (size_t k = 0; k < plan.size(); ++k) {
+				const size_t slot = (in.nslots == 1) ? 0 : plan[k].file;
+				segments::for_each_line(files, plan[k], [&](std::string_view line) {
+					if (!line.empty())
+						local->words += count_line(line, slot, *local, in);
+				});
+			}
+		} else {
+			Splitter splitter(in);
+			Chunk* chunk = new Chunk;
+			while (splitter.fill(*chunk)) {
+				#pragma omp task firstprivate(chunk)
+				{
+					count_chunk(*chunk, *local, in);
+					delete chunk;
+				}
+				chunk = new Chunk;
+			}
+			delete chunk;
+		}
+
+		// Wait for all tasks to finish
+		#pragma omp taskwait
+
+		// Use a critical section to update the global maps
+		#pragma omp critical
+		{
+			merge(counts, std::move(*local));
+		}
+		delete local;
+	}
+	return true;
+}
+
+} // namespace wc
+
+#endif // WC_OMP_HPP
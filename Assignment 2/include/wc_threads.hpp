@@ -0,0 +1,85 @@
+#ifndef WC_THREADS_HPP
+#define WC_THREADS_HPP
+
+//
+// std::thread backend: the calling thread splits the input into a bounded
+// queue of chunk buffers, nth workers count them into their own tables.
+// Processed buffers go back to a free list, as in the FastFlow farm.
+//
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <wordcount.hpp>
+
+namespace wc {
+
+// blocking queue of chunk buffers, nullptr marks the end of the stream
+class ChunkQueue {
+
+public:
+	void push(Chunk* c) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(c);
+		}
+		cv.notify_one();
+	}
+
+	Chunk* pop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this]() { return !queue.empty(); });
+		Chunk* c = queue.front();
+		if (c != nullptr)
+			queue.pop_front();  // the end marker stays for the other workers
+		return c;
+	}
+
+private:
+	std::deque<Chunk*> queue;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+inline bool count_threads(const Input& in, int nth, Counts& counts, size_t buffers_per_worker = 4) {
+	ChunkQueue tasks, free_list;
+	std::vector<Counts> local(nth);
+
+	std::vector<std::thread> workers;
+	for (int w = 0; w < nth; ++w) {
+		workers.emplace_back([&, w]() {
+			reset(local[w], in);
+			while (Chunk* c = tasks.pop()) {
+				count_chunk(*c, local[w], in);
+				free_list.push(c);
+			}
+		});
+	}
+
+	std::vector<std::unique_ptr<Chunk>> buffers;
+	for (size_t i = 0; i < buffers_per_worker * nth; ++i) {
+		buffers.push_back(std::make_unique<Chunk>());
+		free_list.push(buffers.back().get());
+	}
+
+	Splitter splitter(in);
+	while (true) {
+		Chunk* c = free_list.pop();
+		if (!splitter.fill(*c))
+			break;
+		tasks.push(c);
+	}
+	tasks.push(nullptr);
+
+	reset(counts, in);
+	for (int w = 0; w < nth; ++w) {
+		workers[w].join();
+		merge(counts, std::move(local[w]));
+	}
+	return true;
+}
+
+} // namespace wc
+
+#endif // WC_THREADS_HPP
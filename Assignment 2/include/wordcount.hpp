@@ -0,0 +1,572 @@
+#ifndef WORDCOUNT_HPP
+#define WORDCOUNT_HPP
+
+//
+// Word-count core shared by every program and execution backend:
+//  - the command line (options, positional arguments, file list);
+//  - the chunk producer over the asynchronous reader (see prefetch.hpp),
+//    with chunks never spanning two file slots;
+//  - the tokenizer and the counting tables (words, or n-grams: see ngram.hpp);
+//  - the final phase: snapshot update, ranking, timings and top-k.
+//
+// The backends (wc_omp.hpp, wc_threads.hpp, and wc_ff.hpp in Assignment 3)
+// only decide how the chunks reach the tokenizer, all of them have the form
+//   bool count_xxx(const Input& in, int nworkers, Counts& counts)
+// and return false when they could not run.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <type_traits>
+#include <snapshot.hpp>
+#include <prefetch.hpp>
+#include <decompress.hpp>
+#include <chunker.hpp>
+#include <ngram.hpp>
+
+namespace wc {
+
+using umap = std::unordered_map<std::string, uint64_t>;
+using pair = std::pair<std::string, uint64_t>;
+
+struct Comp {
+	bool operator()(const pair& p1, const pair& p2) const {
+		return p1.second > p2.second;
+	}
+};
+
+using ranking = std::multiset<pair, Comp>;
+
+// ---------------------------------------------------------------------------
+// command line
+
+struct Options {
+	std::vector<std::string> filenames;
+	uint64_t extrawork{0};
+	size_t topk{10};
+	bool showresults{false};
+	int nth{1};
+	int chunk_size{100};
+	std::string snapshot_file;
+	size_t readahead{4};
+	double target_us{0};
+	bool autotune{false};
+	size_t inflaters{2};
+	int ngram{0};               // 0 counts the words as strings
+};
+
+// program specific option taking a positive integer, e.g. --reducers n
+struct Extra {
+	const char* name;
+	const char* help;
+	size_t* value;
+};
+
+// parses the command line into opt, whose fields hold the program defaults;
+// min_threads is the smallest valid nthreads, 'threads' tells what they are.
+// False (after printing why) when the program must exit with an error
+inline bool parse_args(int argc, char* argv[], Options& opt, int min_threads, const char* threads,
+                       const std::vector<Extra>& extra = {}) {
+	auto usage = [&]() {
+		std::printf("use: %s [--snapshot file] [--readahead n] [--inflaters n] [--adaptive us] [--autotune] [--ngram n]", argv[0]);
+		for (const auto& e : extra)
+			std::printf(" [%s n]", e.name);
+		std::printf(" filelist.txt [extraworkXline] [topk] [showresults] [nthreads] [chunk_size]\n");
+		std::printf("     --snapshot keeps the counts in file, only new or changed files are recounted\n");
+		std::printf("     --readahead is the number of input blocks read in advance, its default value is %zu\n", opt.readahead);
+		std::printf("     --inflaters is the number of threads decompressing gzip/zstd files, its default value is %zu\n", opt.inflaters);
+		std::printf("     --adaptive sizes the chunks in bytes so that a task lasts about us microseconds\n");
+		std::printf("     --ngram counts the sequences of n (1 to %d) consecutive words of a line instead of the words\n", ngram::MAX_N);
+		std::printf("     --autotune picks nthreads, chunk_size and the scheduling on a sample of the input (see autotune.hpp)\n");
+		for (const auto& e : extra)
+			std::printf("     %s %s\n", e.name, e.help);
+		std::printf("     filelist.txt contains one txt filename per line\n");
+		std::printf("     extraworkXline is the extra work done for each line, it is an integer value whose default is 0\n");
+		std::printf("     topk is an integer number, its default value is %zu (top %zu words)\n", opt.topk, opt.topk);
+		std::printf("     showresults is 0 or 1, if 1 the output is shown on the standard output\n");
+		std::printf("     nthreads is the number of %s, its default value is %d\n", threads, opt.nth);
+		std::printf("     chunk_size is the maximum number of lines to process in a single task, its default value is %d (unused with --adaptive)\n\n", opt.chunk_size);
+		return false;
+	};
+
+	// stoul and stol accepting the whole string only
+	auto number = [](const char* s, auto& value) {
+		try {
+			size_t pos;
+			if constexpr (std::is_same_v<std::decay_t<decltype(value)>, double>)
+				value = std::stod(s, &pos);
+			else
+				value = std::stol(s, &pos);
+			if (s[pos] == '\0')
+				return true;
+			std::printf("%s is an invalid number\n", s);
+		} catch (std::exception const& ex) {
+			std::printf("%s is an invalid number (%s)\n", s, ex.what());
+		}
+		return false;
+	};
+
+	// options are removed from argv before parsing the positional arguments
+	for (int i = 1; i < argc;) {
+		const std::string name = argv[i];
+		if (name == "--autotune") {
+			opt.autotune = true;
+			std::copy(argv + i + 1, argv + argc + 1, argv + i);
+			--argc;
+			continue;
+		}
+		auto e = std::find_if(extra.begin(), extra.end(), [&](const Extra& e) { return name == e.name; });
+		if (name != "--snapshot" && name != "--readahead" && name != "--inflaters" && name != "--adaptive" &&
+		    name != "--ngram" && e == extra.end()) {
+			++i;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return usage();
+		if (name == "--snapshot") {
+			opt.snapshot_file = argv[i + 1];
+		} else if (name == "--adaptive") {
+			if (!number(argv[i + 1], opt.target_us))
+				return false;
+			if (opt.target_us <= 0) {
+				std::printf("%s must be a positive number\n", argv[i + 1]);
+				return false;
+			}
+		} else {
+			long value;
+			if (!number(argv[i + 1], value))
+				return false;
+			if (value <= 0) {
+				std::printf("%s must be a positive integer\n", argv[i + 1]);
+				return false;
+			}
+			if (name == "--ngram") {
+				if (value > ngram::MAX_N) {
+					std::printf("%s, n-grams are at most %d words long\n", argv[i + 1], ngram::MAX_N);
+					return false;
+				}
+				opt.ngram = value;
+			} else {
+				*(e != extra.end() ? e->value : name == "--readahead" ? &opt.readahead : &opt.inflaters) = value;
+			}
+		}
+		std::copy(argv + i + 2, argv + argc + 1, argv + i);
+		argc -= 2;
+	}
+
+	if (argc < 2 || argc > 7)
+		return usage();
+	if (opt.ngram > 0 && !opt.snapshot_file.empty()) {
+		std::printf("--snapshot keeps word counts, it cannot be used with --ngram\n");
+		return false;
+	}
+
+	long value;
+	if (argc > 2) {
+		if (!number(argv[2], value))
+			return false;
+		opt.extrawork = std::max(value, 0l);
+	}
+	if (argc > 3) {
+		if (!number(argv[3], value))
+			return false;
+		if (value <= 0) {
+			std::printf("%s must be a positive integer\n", argv[3]);
+			return false;
+		}
+		opt.topk = value;
+	}
+	if (argc > 4) {
+		if (!number(argv[4], value))
+			return false;
+		opt.showresults = (value == 1);
+	}
+	if (argc > 5) {
+		if (!number(argv[5], value))
+			return false;
+		if (value < min_threads) {
+			std::printf("%s, number of threads must be >= %d\n", argv[5], min_threads);
+			return false;
+		}
+		opt.nth = value;
+	}
+	if (argc > 6) {
+		if (!number(argv[6], value))
+			return false;
+		if (value <= 0) {
+			std::printf("%s must be a positive integer\n", argv[6]);
+			return false;
+		}
+		opt.chunk_size = value;
+	}
+
+	if (!std::filesystem::is_regular_file(argv[1])) {
+		std::printf("%s is not a regular file\n", argv[1]);
+		return usage();
+	}
+	std::ifstream file(argv[1], std::ios_base::in);
+	if (!file.is_open()) {
+		std::printf("ERROR: opening file %s\n", argv[1]);
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		if (std::filesystem::is_regular_file(line))
+			opt.filenames.push_back(line);
+		else
+			std::cout << line << " is not a regular file, skipping it\n";
+	}
+	return true;
+}
+
+// ---------------------------------------------------------------------------
+// chunks and tokenizer
+
+// lines of one file slot (all the files share slot 0 unless a snapshot is
+// kept); only the first 'count' lines are valid, the strings beyond keep
+// their capacity when the buffer is reused
+struct Chunk {
+	size_t slot{0};
+	std::vector<std::string> lines;
+	size_t count{0};
+	size_t bytes{0};
+};
+
+// what a backend has to count
+struct Input {
+	const std::vector<std::string>& files;
+	size_t nslots;              // 1, or one table per file
+	size_t readahead;           // input blocks read in advance
+	uint64_t extrawork;         // busy loop iterations per line
+	chunker::Controller& controller;
+	uint64_t limit{0};          // bytes to read, 0 for all (calibration samples)
+	bool ondemand{true};        // FastFlow only: on-demand or round-robin scheduling
+	bool blocking{true};        // FastFlow only: blocking or spinning queues
+	size_t inflaters{2};        // decompression threads, when a file is compressed
+	int ngram{0};               // n-gram length, 0 to count the words as strings
+	ngram::Vocabulary* vocab{nullptr};  // token ids shared by the workers (n-grams)
+	uint64_t segment_bytes{0};  // OpenMP only: tasks reading their own segment of a file, 0 to use the splitter
+	std::vector<uint64_t>* hashes{nullptr};  // content hash of every plain file read by the splitter
+	const prefetch::Reader::Ranges* ranges{nullptr};  // plain files only: the byte range of every file to count
+};
+
+// what a backend returns (and what each worker accumulates): one table per
+// slot, of words or of n-grams, and the number of tokens
+struct Counts {
+	std::vector<umap> FM;
+	std::vector<ngram::Table> NM;
+	uint64_t words{0};
+	ngram::Cache cache;         // ids already seen by the worker (n-grams)
+};
+
+// empty tables for every slot of the input
+inline void reset(Counts& c, const Input& in) {
+	c.FM.assign(in.ngram ? 0 : in.nslots, {});
+	c.NM.assign(in.ngram ? in.nslots : 0, {});
+	c.words = 0;
+}
+
+// hashes the blocks of the files on their way to the splitter, so that the
+// snapshot gets the content hash of a counted file without reading it twice
+class Hashing : public prefetch::Source {
+
+public:
+	Hashing(std::unique_ptr<prefetch::Source> source, std::vector<uint64_t>& hashes) :
+		source(std::move(source)), hashes(hashes) {}
+
+	bool next(prefetch::Block& b) override {
+		if (!source->next(b))
+			return false;
+		hasher.update(b.data, b.size);
+		if (b.last) {
+			hashes[b.file] = hasher.finish();
+			hasher = snapshot::Hasher();
+		}
+		return true;
+	}
+
+	void release() override { source->release(); }
+
+private:
+	std::unique_ptr<prefetch::Source> source;
+	std::vector<uint64_t>& hashes;
+	snapshot::Hasher hasher;
+};
+
+// splits the files into chunks as sized by the controller; used by the one
+// thread that feeds the workers. Compressed files are decoded by a pool of
+// threads ahead of it (see decompress.hpp)
+class Splitter {
+
+public:
+	explicit Splitter(const Input& in) :
+		in(in), reader(open(in)), lines(*reader) {}
+
+	// refills c with the next lines, false when the input is over
+	bool fill(Chunk& c) {
+		std::string_view line;
+		size_t file;
+		c.count = 0;
+		c.bytes = 0;
+		while ((in.limit == 0 || consumed < in.limit) && lines.peek(line, file)) {
+			const size_t slot = (in.nslots == 1) ? 0 : file;
+			// a chunk never spans two slots
+			if (c.count > 0 && slot != c.slot)
+				break;
+			if (!line.empty()) {
+				c.slot = slot;
+				if (c.count == c.lines.size())
+					c.lines.emplace_back(line);
+				else
+					c.lines[c.count].assign(line);
+				++c.count;
+				c.bytes += line.size() + 1;
+			}
+			consumed += line.size() + 1;
+			lines.pop();
+			if (c.count > 0 && in.controller.full(c.count, c.bytes))
+				break;
+		}
+		if (c.count > 0)
+			in.controller.issued(c.bytes);
+		return c.count > 0;
+	}
+
+private:
+	static std::unique_ptr<prefetch::Source> open(const Input& in) {
+		if (decompress::any_compressed(in.files))
+			return std::make_unique<decompress::Reader>(in.files, in.inflaters);
+		auto reader = std::make_unique<prefetch::Reader>(in.files, in.readahead, BLOCK_SIZE, in.ranges);
+		if (in.hashes)
+			return std::make_unique<Hashing>(std::move(reader), *in.hashes);
+		return reader;
+	}
+
+	static constexpr size_t BLOCK_SIZE = 4 << 20;
+
+	const Input& in;
+	std::unique_ptr<prefetch::Source> reader;
+	prefetch::Lines lines;
+	uint64_t consumed{0};
+};
+
+// counts the tokens of a line (separated by blanks, \r or \n), returns how many
+inline uint64_t tokenize_line(std::string_view line, umap& UM, uint64_t extrawork = 0) {
+	uint64_t words = 0;
+	size_t p = line.find_first_not_of(" \r\n");
+	while (p != std::string_view::npos) {
+		size_t q = line.find_first_of(" \r\n", p);
+		++UM[std::string(line.substr(p, q == std::string_view::npos ? q : q - p))];
+		++words;
+		p = (q == std::string_view::npos) ? q : line.find_first_not_of(" \r\n", q);
+	}
+	for (volatile uint64_t j{0}; j < extrawork; j++);
+	return words;
+}
+
+// counts a line into the table of slot, returns its number of tokens
+inline uint64_t count_line(std::string_view line, size_t slot, Counts& local, const Input& in) {
+	if (in.ngram == 0)
+		return tokenize_line(line, local.FM[slot], in.extrawork);
+	const uint64_t tokens = ngram::count_line(line, in.ngram, local.NM[slot], *in.vocab, local.cache);
+	for (volatile uint64_t j{0}; j < in.extrawork; j++);
+	return tokens;
+}
+
+// tokenizes a chunk into the table of its slot and reports its duration
+inline void count_chunk(const Chunk& c, Counts& local, const Input& in) {
+	auto t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < c.count; ++i)
+		local.words += count_line(c.lines[i], c.slot, local, in);
+	in.controller.completed(c.bytes, std::chrono::steady_clock::now() - t0);
+}
+
+// adds the tables of 'from' to 'into', the empty ones are just moved
+inline void merge(Counts& into, Counts&& from) {
+	for (size_t s = 0; s < into.FM.size(); ++s) {
+		if (into.FM[s].empty()) {
+			into.FM[s] = std::move(from.FM[s]);
+			continue;
+		}
+		for (const auto& entry : from.FM[s])
+			into.FM[s][entry.first] += entry.second;
+	}
+	for (size_t s = 0; s < into.NM.size(); ++s) {
+		if (into.NM[s].size() == 0)
+			into.NM[s] = std::move(from.NM[s]);
+		else
+			into.NM[s].merge(from.NM[s]);
+	}
+	into.words += from.words;
+}
+
+// the k most frequent words in descending order
+inline std::vector<pair> top(const umap& UM, size_t k) {
+	std::vector<const umap::value_type*> entries;
+	entries.reserve(UM.size());
+	for (const auto& entry : UM)
+		entries.push_back(&entry);
+	k = std::min(k, entries.size());
+	std::partial_sort(entries.begin(), entries.begin() + k, entries.end(),
+	                  [](auto a, auto b) { return a->second > b->second; });
+	std::vector<pair> result;
+	for (size_t i = 0; i < k; ++i)
+		result.push_back(*entries[i]);
+	return result;
+}
+
+// ---------------------------------------------------------------------------
+// one run of a program: the snapshot plan before counting, the final phase after
+
+class Run {
+
+public:
+	explicit Run(const Options& opt) : opt(opt), todo(opt.filenames) {
+		// with a snapshot only the new or changed files are tokenized
+		if (!opt.snapshot_file.empty()) {
+			previous.open(opt.snapshot_file);  // a missing snapshot means a full count
+			failed = !snapshot::make_plan(opt.filenames, previous, plan);
+			todo.clear();
+			for (auto i : plan.changed)
+				todo.push_back(opt.filenames[i]);
+			hashes.assign(todo.size(), 0);
+		}
+		// one table per file is needed by the snapshot, a single one otherwise
+		nslots = opt.snapshot_file.empty() ? 1 : todo.size();
+	}
+
+	// false if the run cannot start (a listed file cannot be read)
+	bool ok() const { return !failed; }
+
+	const std::vector<std::string>& files() const { return todo; }
+	size_t slots() const { return nslots; }
+
+	// the input of the backends for this run
+	Input input(chunker::Controller& controller) {
+		Input in{todo, nslots, opt.readahead, opt.extrawork, controller};
+		in.inflaters = opt.inflaters;
+		in.ngram = opt.ngram;
+		in.vocab = &vocab;
+		if (!opt.snapshot_file.empty())
+			in.hashes = &hashes;
+		return in;
+	}
+
+	// runs the calibration f out of the compute time, its duration is
+	// printed on a line of its own
+	template <typename F>
+	void untimed(F&& f) {
+		const auto begin = std::chrono::steady_clock::now();
+		f();
+		const auto spent = std::chrono::steady_clock::now() - begin;
+		start += spent;
+		std::printf("Tuning time (s) %f\n", std::chrono::duration<double>(spent).count());
+	}
+
+	// seconds since the run started
+	double elapsed() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// updates the snapshot, ranks the words and prints the timings and the results
+	void finish(Counts& counts, const chunker::Controller& controller) {
+		if (opt.ngram)
+			return finish_ngrams(counts, controller);
+
+		ranking rank;
+		if (opt.snapshot_file.empty()) {
+			const double stop1 = elapsed();
+
+			// sorting in descending order
+			rank = ranking(counts.FM[0].begin(), counts.FM[0].end());
+
+			print_times(stop1, elapsed(), controller);
+		} else {
+			// the hashes taken while reading the counted files; a file read
+			// otherwise (compressed, or by segments) keeps an unknown hash
+			for (size_t k = 0; k < plan.changed.size(); ++k)
+				if (plan.stats[plan.changed[k]].hash == 0)
+					plan.stats[plan.changed[k]].hash = hashes[k];
+
+			// the deltas of the changed files, applied to the stored totals
+			const auto totals = snapshot::apply_plan(previous, plan, counts.FM);
+
+			const double stop1 = elapsed();
+
+			// sorting in descending order, straight from the totals
+			counts.words = 0;
+			totals.for_each([&](std::string_view w, uint64_t count) {
+				rank.emplace(std::string(w), count);
+				counts.words += count;
+			});
+
+			const double stop2 = elapsed();
+			print_times(stop1, stop2, controller);
+
+			if (!snapshot::save(opt.snapshot_file, previous, plan, counts.FM, totals))
+				std::printf("ERROR: writing snapshot %s\n", opt.snapshot_file.c_str());
+			std::printf("Recounted files %zu of %zu (removed %zu)\nSnapshot time (s) %f\n",
+			            plan.changed.size(), opt.filenames.size(), plan.removed.size(), elapsed() - stop2);
+		}
+
+		show(rank, rank.size(), counts.words);
+	}
+
+	void print_times(double stop1, double stop2, const chunker::Controller& controller) const {
+		std::printf("Compute time (s) %f\nSorting time (s) %f\n", stop1, stop2 - stop1);
+		controller.print_log();
+	}
+
+	// the top-k words (or n-grams), when requested
+	void show(const ranking& rank, size_t unique, uint64_t words, const std::string& what = "words") const {
+		if (!opt.showresults)
+			return;
+		std::cout << "Unique " << what << " " << unique << "\n";
+		std::cout << "Total " << what << "  " << words << "\n";
+		std::cout << "Top " << opt.topk << " " << what << ":\n";
+		auto top = rank.begin();
+		for (size_t i = 0; i < std::clamp(opt.topk, size_t{1}, rank.size()); ++i)
+			std::cout << top->first << '\t' << top++->second << '\n';
+	}
+
+private:
+	// only the reported n-grams get their text
+	void finish_ngrams(Counts& counts, const chunker::Controller& controller) {
+		const double stop1 = elapsed();
+
+		ranking rank;
+		for (const auto& [key, count] : counts.NM[0].top(opt.topk))
+			rank.emplace(vocab.text(key, opt.ngram), count);
+
+		const double stop2 = elapsed();
+		print_times(stop1, stop2, controller);
+		show(rank, counts.NM[0].size(), counts.NM[0].total(), std::to_string(opt.ngram) + "-grams");
+	}
+
+	const Options& opt;
+	std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+	snapshot::Snapshot previous;
+	snapshot::Plan plan;
+	std::vector<std::string> todo;
+	size_t nslots{1};
+	std::vector<uint64_t> hashes;   // of the files in todo, see Hashing
+	bool failed{false};
+	ngram::Vocabulary vocab;
+};
+
+} // namespace wc
+
+#endif // WORDCOUNT_HPP
@@ -0,0 +1,201 @@
+#include <ff/ff.hpp>
+#include <wordcount.hpp>
+// g++ -std=c++17 -I./fastflow -I"../Assignment 2/include" -O3 -o Word-Count-FF-a2a Word-Count-FF-a2a.cpp
+// (add -DUSE_IO_URING -luring to read the input through io_uring)
+// (add -DUSE_ZLIB -lz and/or -DUSE_ZSTD -lzstd to read gzip/zstd compressed files)
+
+using namespace ff;
+using wc::umap;
+using wc::pair;
+using wc::Chunk;
+
+// (word, count) pairs of one file slot, all owned by the same reducer
+struct Batch {
+    size_t slot;
+    std::vector<pair> pairs;
+};
+
+// distinct words a tokenizer combines locally before sending them out
+const size_t FLUSH_ENTRIES = 1 << 16;
+
+// index of the reducer owning a word; the hash is remixed so that the
+// buckets of the reducer's own map stay evenly used
+size_t owner(const std::string& word, size_t nreducers) {
+    uint64_t h = std::hash<std::string>{}(word) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) % nreducers;
+}
+
+struct Source: ff_node_t<Chunk> {
+    Source(const wc::Input& in):in(in) {}
+
+    Chunk* svc(Chunk*) {
+        // the files are read ahead asynchronously, this node only
+        // splits the blocks into lines and sends out the chunks
+        wc::Splitter splitter(in);
+        Chunk* chunk = new Chunk;
+        while (splitter.fill(*chunk)) {
+            ff_send_out(chunk);
+            chunk = new Chunk;
+        }
+        delete chunk;
+        return EOS;
+    }
+
+    const wc::Input& in;
+};
+
+// tokenizes the chunks into local combining maps (the table of the current
+// slot only), which are periodically split by owner and sent to the
+// reducers as batches of (word, count) pairs
+struct Tokenizer: ff_monode_t<Chunk, Batch> {
+    Tokenizer(const wc::Input& in, size_t nreducers):in(in), nreducers(nreducers) {
+        wc::reset(local, in);
+    }
+
+    Batch* svc(Chunk* chunk) {
+        if (chunk->slot != slot) {
+            flush();
+            slot = chunk->slot;
+        }
+        wc::count_chunk(*chunk, local, in);
+        delete chunk;
+
+        if (local.FM[slot].size() >= FLUSH_ENTRIES) flush();
+        return GO_ON;
+    }
+
+    void eosnotify(ssize_t) {
+        flush();
+    }
+
+    // moves the combined counts out, one batch per reducer
+    void flush() {
+        auto& local_UM = local.FM[slot];
+        if (local_UM.empty()) return;
+        std::vector<Batch*> batches(nreducers, nullptr);
+        for (auto it = local_UM.begin(); it != local_UM.end();) {
+            auto node = local_UM.extract(it++);
+            size_t r = owner(node.key(), nreducers);
+            if (!batches[r]) batches[r] = new Batch{slot, {}};
+            batches[r]->pairs.emplace_back(std::move(node.key()), node.mapped());
+        }
+        for (size_t r = 0; r < nreducers; ++r)
+            if (batches[r]) ff_send_out_to(batches[r], r);
+    }
+
+    const wc::Input& in;
+    size_t nreducers;
+    size_t slot{0};
+    wc::Counts local;
+};
+
+// owns a disjoint range of the words; at the end it keeps its top-k, so
+// the final ranking only merges nreducers short lists
+struct Reducer: ff_minode_t<Batch> {
+    Reducer(size_t nslots, size_t topk):FM(nslots), topk(topk) {}
+
+    Batch* svc(Batch* batch) {
+        auto& UM = FM[batch->slot];
+        for (auto& p : batch->pairs) {
+            UM[std::move(p.first)] += p.second;
+        }
+        delete batch;
+        return GO_ON;
+    }
+
+    void svc_end() {
+        if (FM.size() != 1) return;  // with a snapshot the ranking needs the totals
+        top = wc::top(FM[0], topk);
+    }
+
+    std::vector<umap> FM;
+    size_t topk;
+    std::vector<pair> top;
+};
+
+int main(int argc, char *argv[]) {
+    wc::Options opt;
+    opt.nth = 3;
+    opt.chunk_size = 10000;
+    size_t nreducers = 0;
+    std::vector<wc::Extra> extra = {
+        {"--reducers", "is the number of reducer threads, its default value is (nthreads-1)/4", &nreducers}};
+    if (!wc::parse_args(argc, argv, opt, 3, "threads (source, tokenizers and reducers)", extra))
+        return -1;
+    if (opt.autotune) {
+        std::printf("--autotune is not supported by the all-to-all pipeline\n");
+        return -1;
+    }
+    if (opt.ngram) {
+        std::printf("--ngram is not supported by the all-to-all pipeline\n");
+        return -1;
+    }
+
+    // one thread reads, the others are split between tokenizers and reducers
+    if (nreducers == 0) nreducers = std::max(1, (opt.nth-1)/4);
+    if (nreducers >= static_cast<size_t>(opt.nth-1)) {
+        std::printf("%zu reducers leave no tokenizer with %d threads\n", nreducers, opt.nth);
+        return -1;
+    }
+    const int ntokenizers = opt.nth - 1 - nreducers;
+
+    // start the time, with a snapshot only the new or changed files are tokenized
+    wc::Run run(opt);
+    if (!run.ok())
+        return -1;
+
+    // fixed number of lines per chunk, or a byte budget driven by the task durations
+    chunker::Controller controller(opt.chunk_size, opt.target_us, ntokenizers);
+    wc::Input in = run.input(controller);
+
+    // Create FastFlow nodes
+    Source source(in);
+    std::vector<Tokenizer*> tokenizers;
+    for (int i = 0; i < ntokenizers; ++i) {
+        tokenizers.push_back(new Tokenizer(in, nreducers));
+    }
+    std::vector<Reducer*> reducers;
+    for (size_t i = 0; i < nreducers; ++i) {
+        reducers.push_back(new Reducer(run.slots(), opt.topk));
+    }
+
+    // reader -> tokenizers (on-demand) -> reducers, each one owning a hash range of the words
+    ff_a2a a2a;
+    a2a.add_firstset(tokenizers, 1);
+    a2a.add_secondset(reducers);
+    ff_Pipe<> pipe(source, a2a);
+
+    // Run the pipeline
+    if (pipe.run_and_wait_end() < 0) {
+        error("running pipeline\n");
+        return -1;
+    }
+
+    wc::Counts counts;
+    counts.FM.resize(run.slots());
+    for (auto t : tokenizers) counts.words += t->local.words;
+
+    if (!opt.snapshot_file.empty()) {
+        // the tables of the reducers are disjoint, their nodes are moved together
+        for (auto r : reducers) {
+            for (size_t s = 0; s < run.slots(); ++s) counts.FM[s].merge(r->FM[s]);
+        }
+        run.finish(counts, controller);
+    } else {
+        auto stop1 = run.elapsed();
+
+        // the words are disjoint among the reducers, merging their top-k lists is enough
+        size_t unique = 0;
+        wc::ranking rank;
+        for (auto r : reducers) {
+            unique += r->FM[0].size();
+            rank.insert(r->top.begin(), r->top.end());
+        }
+
+        run.print_times(stop1, run.elapsed(), controller);
+        run.show(rank, unique, counts.words);
+    }
+
+    for (auto t : tokenizers) delete t;
+    for (auto r : reducers) delete r;
+}
@@ -0,0 +1,125 @@
+#include <wordcount.hpp>
+#include <wc_omp.hpp>
+#include <wc_threads.hpp>
+#include <wc_ff.hpp>
+// g++ -std=c++17 -I./fastflow -I"../Assignment 2/include" -I include/ -O3 -o Word-Count-bench Word-Count-bench.cpp -fopenmp
+// (add -DUSE_IO_URING -luring to read the input through io_uring)
+// (add -DUSE_ZLIB -lz and/or -DUSE_ZSTD -lzstd to read gzip/zstd compressed files)
+
+// Runs the same corpus through every backend of the word-count core, for
+// each number of workers, and checks the tables against a sequential count.
+
+using backend = bool (*)(const wc::Input&, int, wc::Counts&);
+
+// sequential reference: the splitter and the tokenizer on the calling thread
+bool count_seq(const wc::Input& in, int, wc::Counts& counts) {
+    wc::reset(counts, in);
+    wc::Splitter splitter(in);
+    wc::Chunk chunk;
+    while (splitter.fill(chunk)) {
+        wc::count_chunk(chunk, counts, in);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 5) {
+        std::printf("use: %s filelist.txt [nworkers] [chunk_size] [runs]\n", argv[0]);
+        std::printf("     filelist.txt contains one txt filename per line\n");
+        std::printf("     nworkers is a comma separated list of worker counts, its default value is 1,2,4,8\n");
+        std::printf("     chunk_size is the number of lines to process in a single task, its default value is 1000\n");
+        std::printf("     runs is the number of runs of each configuration (the best one is kept), its default value is 3\n\n");
+        return -1;
+    }
+
+    std::vector<int> nworkers;
+    int chunk_size = 1000;
+    int runs = 3;
+    try {
+        std::string list = (argc > 2) ? argv[2] : "1,2,4,8";
+        for (size_t p = 0; p < list.size();) {
+            size_t q = list.find(',', p);
+            if (q == std::string::npos) q = list.size();
+            nworkers.push_back(std::stoi(list.substr(p, q - p)));
+            p = q + 1;
+        }
+        if (argc > 3) chunk_size = std::stoi(argv[3]);
+        if (argc > 4) runs = std::stoi(argv[4]);
+    } catch (std::exception const& ex) {
+        std::printf("invalid number (%s)\n", ex.what());
+        return -1;
+    }
+    if (chunk_size <= 0 || runs <= 0 || nworkers.empty() ||
+        *std::min_element(nworkers.begin(), nworkers.end()) <= 0) {
+        std::printf("the arguments must be positive integers\n");
+        return -1;
+    }
+
+    std::vector<std::string> filenames;
+    std::ifstream file(argv[1], std::ios_base::in);
+    if (!file.is_open()) {
+        std::printf("ERROR: opening file %s\n", argv[1]);
+        return -1;
+    }
+    std::string line;
+    uint64_t total_bytes = 0;
+    while (std::getline(file, line)) {
+        if (std::filesystem::is_regular_file(line)) {
+            filenames.push_back(line);
+            total_bytes += std::filesystem::file_size(line);
+        } else {
+            std::cout << line << " is not a regular file, skipping it\n";
+        }
+    }
+
+    // the best time of 'runs' runs of a backend
+    auto measure = [&](backend count, int n, wc::Counts& counts) {
+        double best = -1;
+        for (int r = 0; r < runs; ++r) {
+            chunker::Controller controller(chunk_size);
+            wc::Input in{filenames, 1, 4, 0, controller};
+            auto t0 = std::chrono::steady_clock::now();
+            if (!count(in, n, counts)) return -1.0;
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            if (best < 0 || t < best) best = t;
+        }
+        return best;
+    };
+
+    wc::Counts reference;
+    const double seq_time = measure(count_seq, 1, reference);
+
+    std::printf("%zu files, %.1f MB, %lu tokens, %zu unique words, chunk_size %d, best of %d runs\n\n",
+                filenames.size(), total_bytes / 1e6, reference.words, reference.FM[0].size(), chunk_size, runs);
+    std::printf("%-10s %8s %10s %10s %12s %8s %6s\n", "backend", "workers", "time (s)", "MB/s", "Mtokens/s", "speedup", "match");
+    auto row = [&](const char* name, int n, double t, bool match) {
+        std::printf("%-10s %8d %10.4f %10.1f %12.2f %8.2f %6s\n", name, n, t,
+                    total_bytes / 1e6 / t, reference.words / 1e6 / t, seq_time / t, match ? "yes" : "NO");
+    };
+    row("seq", 1, seq_time, true);
+
+    const std::vector<std::pair<const char*, backend>> backends = {
+        {"omp", wc::count_omp},
+        {"threads", [](const wc::Input& in, int n, wc::Counts& c) { return wc::count_threads(in, n, c); }},
+        {"ff-farm", wc::count_ff_farm},
+        {"ff-wrap", wc::count_ff_wrap},
+    };
+
+    // one scaling curve per backend, the speedup is over the sequential count
+    bool all_match = true;
+    for (const auto& [name, count] : backends) {
+        for (int n : nworkers) {
+            wc::Counts counts;
+            double t = measure(count, n, counts);
+            if (t < 0) {
+                std::printf("%-10s %8d failed\n", name, n);
+                all_match = false;
+                continue;
+            }
+            bool match = counts.words == reference.words && counts.FM[0] == reference.FM[0];
+            all_match = all_match && match;
+            row(name, n, t, match);
+        }
+    }
+    return all_match ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+#ifndef WC_FF_HPP
+#define WC_FF_HPP
+
+//
+// FastFlow backends of the word-count core (see wordcount.hpp):
+//  - count_ff_farm: Source -> Workers -> Sink farm, the chunk buffers come
+//    back to the source through the feedback channels and every worker
+//    sends its tables to the sink once, at the end of the stream;
+//  - count_ff_wrap: a single SourceSink node feeds the workers and merges
+//    the tables they return for every chunk (wrap-around farm, no collector).
+//
+
+#include <ff/ff.hpp>
+#include <wordcount.hpp>
+
+namespace wc {
+
+namespace ffwc {
+
+// accumulates every chunk in its own local maps, which are sent to the sink
+// only once at the end of the stream; the chunks go back to the source
+struct Worker: ff::ff_monode_t<Chunk, Counts> {
+	Worker(const Input& in) : in(in) { reset(local, in); }
+
+	Counts* svc(Chunk* chunk) {
+		count_chunk(*chunk, local, in);
+		// the feedback channel comes first, the collector is channel 1
+		ff_send_out_to(chunk, 0);
+		return GO_ON;
+	}
+
+	void eosnotify(ssize_t) {
+		ff_send_out_to(new Counts(std::move(local)), 1);
+	}
+
+	const Input& in;
+	Counts local;
+};
+
+// fills the free chunk buffers with lines; the buffers come back through the
+// feedback channel once processed, so in steady state nothing is allocated
+struct Source: ff::ff_node_t<Chunk> {
+	Source(const Input& in, size_t nbuffers) : in(in), nbuffers(nbuffers) {}
+
+	int svc_init() {
+		splitter = std::make_unique<Splitter>(in);
+		return 0;
+	}
+
+	Chunk* svc(Chunk* chunk) {
+		if (chunk == nullptr) {
+			for (size_t i = 0; i < nbuffers; ++i) free_list.push_back(new Chunk);
+		} else {
+			free_list.push_back(chunk);
+			--outstanding;
+		}
+
+		while (!eof && !free_list.empty()) {
+			Chunk* c = free_list.back();
+			if (!splitter->fill(*c)) {
+				eof = true;
+				break;
+			}
+			free_list.pop_back();
+			ff_send_out(c);
+			++outstanding;
+		}
+
+		if (eof && outstanding == 0) {
+			for (auto c : free_list) delete c;
+			free_list.clear();
+			return EOS;
+		}
+		return GO_ON;
+	}
+
+	void svc_end() { splitter.reset(); }
+
+	const Input& in;
+	size_t nbuffers;
+	std::unique_ptr<Splitter> splitter;
+	std::vector<Chunk*> free_list;
+	size_t outstanding{0};
+	bool eof{false};
+};
+
+// merges the local maps of the workers, one message per worker
+struct Sink: ff::ff_node_t<Counts, float> {
+	Sink(const Input& in) { reset(counts, in); }
+
+	float* svc(Counts* local) {
+		merge(counts, std::move(*local));
+		delete local;
+		return GO_ON;
+	}
+
+	Counts counts;
+};
+
+// counts every chunk into new tables and returns them to the SourceSink
+// (the cache of the n-gram ids stays with the worker)
+struct WrapWorker: ff::ff_node_t<Chunk, Counts> {
+	WrapWorker(const Input& in) : in(in) {}
+
+	Counts* svc(Chunk* chunk) {
+		auto local = new Counts;
+		reset(*local, in);
+		local->cache.swap(cache);
+		count_chunk(*chunk, *local, in);
+		cache.swap(local->cache);
+		delete chunk;
+		return local;
+	}
+
+	const Input& in;
+	ngram::Cache cache;
+};
+
+struct SourceSink: ff::ff_monode_t<Counts, Chunk> {
+	SourceSink(const Input& in) : in(in) { reset(counts, in); }
+
+	Chunk* svc(Counts* local) {
+		if (local == nullptr) {
+			Splitter splitter(in);
+			Chunk* c = new Chunk;
+			while (splitter.fill(*c)) {
+				ff_send_out(c);
+				c = new Chunk;
+			}
+			delete c;
+			broadcast_task(EOS);
+			return GO_ON;
+		}
+
+		merge(counts, std::move(*local));
+		delete local;
+		return GO_ON;
+	}
+
+	const Input& in;
+	Counts counts;
+};
+
+} // namespace ffwc
+
+// number of chunk buffers circulating between the source and each worker
+const size_t BUFFERS_PER_WORKER = 4;
+
+// false when the farm could not run
+inline bool count_ff_farm(const Input& in, int nworkers, Counts& counts) {
+	ffwc::Source source(in, BUFFERS_PER_WORKER * nworkers);
+	std::vector<std::unique_ptr<ff::ff_node>> workers;
+	for (int i = 0; i < nworkers; ++i)
+		workers.push_back(std::make_unique<ffwc::Worker>(in));
+	ffwc::Sink sink(in);
+
+	// the feedback channels bring the chunks back to the source
+	ff::ff_Farm<> farm(std::move(workers), source, sink);
+	if (in.ondemand)
+		farm.set_scheduling_ondemand();
+	farm.wrap_around();
+	farm.blocking_mode(in.blocking);
+
+	if (farm.run_and_wait_end() < 0) {
+		ff::error("running farm\n");
+		return false;
+	}
+	counts = std::move(sink.counts);
+	return true;
+}
+
+inline bool count_ff_wrap(const Input& in, int nworkers, Counts& counts) {
+	ffwc::SourceSink source_sink(in);
+	std::vector<std::unique_ptr<ff::ff_node>> workers;
+	for (int i = 0; i < nworkers; ++i)
+		workers.push_back(std::make_unique<ffwc::WrapWorker>(in));
+
+	ff::ff_Farm<> farm(std::move(workers), source_sink);
+	farm.remove_collector();
+	farm.wrap_around();
+	if (in.ondemand)
+		farm.set_scheduling_ondemand();
+	farm.blocking_mode(in.blocking);
+
+	if (farm.run_and_wait_end() < 0) {
+		ff::error("running farm\n");
+		return false;
+	}
+	counts = std::move(source_sink.counts);
+	return true;
+}
+
+} // namespace wc
+
+#endif // WC_FF_HPP
@@ -0,0 +1,250 @@
+#include <mpi.h>
+#include <cstring>
+#include <climits>
+#include <wordcount.hpp>
+#include <wc_threads.hpp>
+#include <segments.hpp>
+// mpicxx -std=c++20 -O3 -I"../Assignment 2/include" -o Word-Count-mpi Word-Count-mpi.cpp -pthread   (or make Word-Count-mpi)
+// (add -DUSE_IO_URING -luring to read the input through io_uring)
+// (add -DUSE_ZLIB -lz and/or -DUSE_ZSTD -lzstd to read gzip/zstd compressed files)
+// mpirun -n 4 ./Word-Count-mpi filelist.txt 0 10 1 2
+
+// Word count over MPI. Every rank counts a byte-balanced share of the file
+// list with the threaded engine (wc_threads.hpp, nthreads threads per rank):
+// the files, one after the other, are cut at line boundaries into equal
+// byte ranges (whole files, the largest first, when some are compressed),
+// then the (word, count) pairs are hash-partitioned among the ranks with
+// MPI_Alltoallv, so that every word is owned by one rank that holds its
+// total count. Each owner sends its local top-k to rank 0, which merges them:
+// the words of different owners are distinct, so the top-k of the union is
+// the global one.
+
+// bytes sent by a rank in a round of the exchange, split evenly among the
+// destinations (the counts and the displacements of MPI_Alltoallv are ints)
+const size_t ROUND_BYTES = 64 << 20;
+
+// owner of a word, the same on every rank (FNV-1a, std::hash may differ between builds)
+int owner(const std::string& word, int nranks) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (unsigned char c : word) h = (h ^ c) * 0x100000001B3ULL;
+    return h % nranks;
+}
+
+// whole files, the largest first, to the rank with the fewest bytes so far
+std::vector<std::string> share_files(const std::vector<std::string>& files, int rank, int nranks, std::vector<uint64_t>& load) {
+    std::vector<std::pair<uint64_t, size_t>> sizes;
+    for (size_t i = 0; i < files.size(); ++i)
+        sizes.emplace_back(std::filesystem::file_size(files[i]), i);
+    std::stable_sort(sizes.begin(), sizes.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    load.assign(nranks, 0);
+    std::vector<size_t> mine;
+    for (const auto& [bytes, i] : sizes) {
+        int r = std::min_element(load.begin(), load.end()) - load.begin();
+        load[r] += bytes;
+        if (r == rank) mine.push_back(i);
+    }
+    // the rank still reads its files in list order
+    std::sort(mine.begin(), mine.end());
+    std::vector<std::string> result;
+    for (auto i : mine) result.push_back(files[i]);
+    return result;
+}
+
+// the files one after the other cut into nranks parts of the same size,
+// every cut moved to the start of the next line (all the ranks find the
+// same cuts): the files the part of rank touches, with their byte ranges
+std::vector<std::string> share(const std::vector<std::string>& files, int rank, int nranks, std::vector<uint64_t>& load,
+                               prefetch::Reader::Ranges& ranges) {
+    std::vector<uint64_t> start(files.size() + 1, 0);
+    for (size_t i = 0; i < files.size(); ++i)
+        start[i + 1] = start[i] + std::filesystem::file_size(files[i]);
+    const uint64_t total = start.back();
+
+    std::vector<uint64_t> cut(nranks + 1, total);
+    cut[0] = 0;
+    for (int r = 1; r < nranks; ++r) {
+        const uint64_t at = total / nranks * r + std::min<uint64_t>(r, total % nranks);
+        const size_t f = std::upper_bound(start.begin(), start.end(), at) - start.begin() - 1;
+        uint64_t line = at;
+        if (at < total && at > start[f]) {
+            int fd = ::open(files[f].c_str(), O_RDONLY);
+            if (fd >= 0) {
+                line = start[f] + segments::next_line(fd, at - start[f], start[f + 1] - start[f]);
+                ::close(fd);
+            }
+        }
+        cut[r] = std::max(line, cut[r - 1]);
+    }
+
+    load.assign(nranks, 0);
+    for (int r = 0; r < nranks; ++r) load[r] = cut[r + 1] - cut[r];
+    std::vector<std::string> result;
+    ranges.clear();
+    for (size_t i = 0; i < files.size(); ++i) {
+        const uint64_t begin = std::max(cut[rank], start[i]), end = std::min(cut[rank + 1], start[i + 1]);
+        if (begin < end) {
+            result.push_back(files[i]);
+            ranges.emplace_back(begin - start[i], end - start[i]);
+        }
+    }
+    return result;
+}
+
+// a (length, word, count) record
+void put(std::string& buffer, const std::string& word, uint64_t count) {
+    uint32_t len = word.size();
+    buffer.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buffer.append(word);
+    buffer.append(reinterpret_cast<const char*>(&count), sizeof(count));
+}
+
+// calls f(word, count) for every record of buffer
+template <typename F>
+void for_each_record(const std::string& buffer, F f) {
+    for (size_t p = 0; p < buffer.size();) {
+        uint32_t len;
+        uint64_t count;
+        std::memcpy(&len, buffer.data() + p, sizeof(len));
+        p += sizeof(len);
+        std::string word(buffer, p, len);
+        p += len;
+        std::memcpy(&count, buffer.data() + p, sizeof(count));
+        p += sizeof(count);
+        f(std::move(word), count);
+    }
+}
+
+// sends out[d] to rank d and receives in[s] from rank s, in as many rounds
+// of at most ROUND_BYTES / nranks per pair of ranks as the longest buffer
+// needs, so that what a rank sends or receives in a round fits in an int
+void exchange(const std::vector<std::string>& out, std::vector<std::string>& in, int nranks) {
+    const size_t piece = std::max<size_t>(ROUND_BYTES / nranks, 1);
+    uint64_t longest = 0;
+    for (const auto& b : out) longest = std::max<uint64_t>(longest, b.size());
+    MPI_Allreduce(MPI_IN_PLACE, &longest, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+    const uint64_t rounds = (longest + piece - 1) / piece;
+
+    in.assign(nranks, {});
+    std::vector<int> sendcounts(nranks), sdispls(nranks), recvcounts(nranks), rdispls(nranks);
+    std::string sendbuf, recvbuf;
+    for (uint64_t r = 0; r < rounds; ++r) {
+        const size_t from = r * piece;
+        sendbuf.clear();
+        for (int d = 0; d < nranks; ++d) {
+            sdispls[d] = sendbuf.size();
+            if (out[d].size() > from) sendbuf.append(out[d], from, piece);
+            sendcounts[d] = sendbuf.size() - sdispls[d];
+        }
+        MPI_Alltoall(sendcounts.data(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+        size_t total = 0;
+        for (int s = 0; s < nranks; ++s) {
+            rdispls[s] = total;
+            total += recvcounts[s];
+        }
+        if (sendbuf.size() > INT_MAX || total > INT_MAX) {
+            std::printf("ERROR: a round of the exchange does not fit in an int\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        recvbuf.resize(total);
+        MPI_Alltoallv(sendbuf.data(), sendcounts.data(), sdispls.data(), MPI_CHAR,
+                      recvbuf.data(), recvcounts.data(), rdispls.data(), MPI_CHAR, MPI_COMM_WORLD);
+        // a record may be split between two rounds, the streams are parsed at the end
+        for (int s = 0; s < nranks; ++s) in[s].append(recvbuf, rdispls[s], recvcounts[s]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank, nranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+    // every rank parses the same command line, only rank 0 prints
+    if (rank != 0 && !std::freopen("/dev/null", "w", stdout)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    wc::Options opt;
+    opt.chunk_size = 1000;
+    bool ok = wc::parse_args(argc, argv, opt, 1, "threads of every rank");
+    if (ok && (!opt.snapshot_file.empty() || opt.autotune || opt.ngram)) {
+        std::printf("--snapshot, --autotune and --ngram are not supported by the MPI version\n");
+        ok = false;
+    }
+    if (!ok) {
+        MPI_Finalize();
+        return -1;
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    wc::Run run(opt);
+
+    // local count of the share of the rank
+    std::vector<uint64_t> load;
+    prefetch::Reader::Ranges ranges;
+    const bool compressed = decompress::any_compressed(opt.filenames);
+    const auto files = compressed ? share_files(opt.filenames, rank, nranks, load)
+                                  : share(opt.filenames, rank, nranks, load, ranges);
+    chunker::Controller controller(opt.chunk_size, opt.target_us, opt.nth);
+    wc::Input in{files, 1, opt.readahead, opt.extrawork, controller};
+    in.inflaters = opt.inflaters;
+    if (!compressed) in.ranges = &ranges;
+    wc::Counts counts;
+    if (!wc::count_threads(in, opt.nth, counts)) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    const double stop1 = run.elapsed();
+
+    // every word goes to its owner, which adds up the counts of all the ranks
+    std::vector<std::string> out(nranks), received;
+    for (auto& entry : counts.FM[0]) put(out[owner(entry.first, nranks)], entry.first, entry.second);
+    counts.FM[0].clear();
+    exchange(out, received, nranks);
+    out.clear();
+    wc::umap UM;
+    for (auto& stream : received) {
+        for_each_record(stream, [&](std::string&& word, uint64_t count) { UM[std::move(word)] += count; });
+        stream = std::string();
+    }
+    const double stop2 = run.elapsed();
+
+    // the local top-k of the owners, merged on rank 0
+    std::string mine;
+    for (const auto& [word, count] : wc::top(UM, opt.topk)) put(mine, word, count);
+    int size = mine.size();
+    std::vector<int> sizes(nranks), displs(nranks);
+    MPI_Gather(&size, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::string all;
+    if (rank == 0) {
+        size_t total = 0;
+        for (int r = 0; r < nranks; ++r) {
+            displs[r] = total;
+            total += sizes[r];
+        }
+        all.resize(total);
+    }
+    MPI_Gatherv(mine.data(), size, MPI_CHAR, all.data(), sizes.data(), displs.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    uint64_t unique = UM.size(), words = counts.words;
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &unique, &unique, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &words, &words, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    wc::umap best;
+    if (rank == 0) for_each_record(all, [&](std::string&& word, uint64_t count) { best.emplace(std::move(word), count); });
+    const auto top = wc::top(best, opt.topk);
+    wc::ranking ranking(top.begin(), top.end());
+    const double stop3 = run.elapsed();
+
+    // the slowest rank decides every phase
+    double times[3] = {stop1, stop2 - stop1, stop3 - stop2};
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : times, times, 3, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    std::printf("Ranks %d, input per rank (MB) min %f max %f\n", nranks,
+                *std::min_element(load.begin(), load.end()) / 1e6, *std::max_element(load.begin(), load.end()) / 1e6);
+    std::printf("Compute time (s) %f\nExchange time (s) %f\nSorting time (s) %f\n", times[0], times[1], times[2]);
+    controller.print_log();
+    run.show(ranking, unique, words);
+
+    MPI_Finalize();
+}
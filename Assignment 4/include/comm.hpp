@@ -0,0 +1,200 @@
+#ifndef COMM_HPP
+#define COMM_HPP
+
+//
+// Non-blocking messaging for nkeyspar:
+//  - Sends: a pool of MPI_Isend slots, each one with its own copy of the
+//    message; a slot is reused once its send has completed, so the sender
+//    never waits for the receiver;
+//  - Receives: a number of MPI_Irecv posted in advance on a tag, from any
+//    rank; poll() tests them all with MPI_Testsome and hands out the
+//    messages that have arrived, posting the receives again. MPI matches
+//    the receives in the order they were posted, so the messages are handed
+//    out in that order (a ring): the messages of a rank keep their order;
+//  - Batches: messages of a fixed number of elements gathered per
+//    destination and sent together, when the batch is full or when its
+//    first message has waited long enough.
+//
+
+#include <cstdint>
+#include <vector>
+#include <mpi.h>
+
+namespace comm {
+
+template <typename T>
+class Sends {
+
+public:
+	explicit Sends(MPI_Datatype type) : type(type) {}
+
+	Sends(const Sends&) = delete;
+	Sends& operator=(const Sends&) = delete;
+
+	// copies count elements of data and starts sending them
+	void send(const T* data, int count, int dest, int tag) {
+		const size_t s = slot();
+		buffers[s].assign(data, data + count);
+		MPI_Isend(buffers[s].data(), count, type, dest, tag, MPI_COMM_WORLD, &requests[s]);
+	}
+
+	void wait_all() {
+		MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+		free.clear();
+		for (size_t s = 0; s < requests.size(); ++s)
+			free.push_back(s);
+	}
+
+	size_t slots() const { return requests.size(); }
+
+private:
+	// a free slot: one already completed, one completing now, or a new one
+	size_t slot() {
+		if (free.empty() && !requests.empty()) {
+			int completed;
+			indices.resize(requests.size());
+			MPI_Testsome(requests.size(), requests.data(), &completed, indices.data(), MPI_STATUSES_IGNORE);
+			for (int i = 0; i < completed && completed != MPI_UNDEFINED; ++i)
+				free.push_back(indices[i]);
+		}
+		if (free.empty()) {
+			requests.push_back(MPI_REQUEST_NULL);
+			buffers.emplace_back();
+			return requests.size() - 1;
+		}
+		const size_t s = free.back();
+		free.pop_back();
+		return s;
+	}
+
+	MPI_Datatype type;
+	std::vector<MPI_Request> requests;
+	std::vector<std::vector<T>> buffers;
+	std::vector<size_t> free;
+	std::vector<int> indices;
+};
+
+template <typename T>
+class Receives {
+
+public:
+	// depth receives of at most count elements each
+	Receives(MPI_Datatype type, int count, int tag, size_t depth) :
+		type(type), count(count), tag(tag), requests(depth), buffers(depth, std::vector<T>(count)),
+		indices(depth), arrived(depth), statuses(depth), done(depth) {
+		for (size_t i = 0; i < depth; ++i)
+			post(i);
+	}
+
+	Receives(const Receives&) = delete;
+	Receives& operator=(const Receives&) = delete;
+
+	// calls f(source, data, n) for every message arrived, waiting for at
+	// least one when wait is true; returns the number of messages
+	template <typename F>
+	int poll(bool wait, F&& f) {
+		int completed;
+		MPI_Testsome(requests.size(), requests.data(), &completed, indices.data(), arrived.data());
+		for (int i = 0; i < completed && completed != MPI_UNDEFINED; ++i) {
+			done[indices[i]] = true;
+			statuses[indices[i]] = arrived[i];
+		}
+		if (wait && !done[head]) {
+			MPI_Wait(&requests[head], &statuses[head]);
+			done[head] = true;
+		}
+		int delivered = 0;
+		for (; done[head]; head = (head + 1) % requests.size(), ++delivered) {
+			int n;
+			MPI_Get_count(&statuses[head], type, &n);
+			f(statuses[head].MPI_SOURCE, buffers[head].data(), n);
+			done[head] = false;
+			post(head);
+		}
+		return delivered;
+	}
+
+	// withdraws the receives still posted
+	void cancel() {
+		for (auto& r : requests) {
+			if (r == MPI_REQUEST_NULL)
+				continue;
+			MPI_Cancel(&r);
+			MPI_Wait(&r, MPI_STATUS_IGNORE);
+		}
+	}
+
+private:
+	void post(size_t i) {
+		MPI_Irecv(buffers[i].data(), count, type, MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &requests[i]);
+	}
+
+	MPI_Datatype type;
+	int count;
+	int tag;
+	std::vector<MPI_Request> requests;
+	std::vector<std::vector<T>> buffers;
+	std::vector<int> indices;
+	std::vector<MPI_Status> arrived;    // filled by MPI_Testsome
+	std::vector<MPI_Status> statuses;   // of every receive
+	std::vector<char> done;     // arrived, not handed out yet
+	size_t head{0};             // the receive posted first
+};
+
+template <typename T>
+class Batches {
+
+public:
+	// batches of at most size messages of width elements, sent with tag
+	// through sends; a batch is old after latency seconds
+	Batches(Sends<T>& sends, int ndest, size_t size, size_t width, int tag, double latency) :
+		sends(sends), size(size), width(width), tag(tag), latency(latency), batches(ndest), since(ndest) {}
+
+	Batches(const Batches&) = delete;
+	Batches& operator=(const Batches&) = delete;
+
+	void add(const T* message, int dest, double now) {
+		auto& batch = batches[dest];
+		if (batch.empty())
+			since[dest] = now;
+		batch.insert(batch.end(), message, message + width);
+		if (batch.size() == size * width)
+			flush(dest);
+	}
+
+	void flush(int dest) {
+		auto& batch = batches[dest];
+		if (batch.empty())
+			return;
+		sends.send(batch.data(), batch.size(), dest, tag);
+		++messages;
+		batch.clear();
+	}
+
+	void flush_all() {
+		for (size_t d = 0; d < batches.size(); ++d)
+			flush(d);
+	}
+
+	// sends the batches waiting since latency seconds or more
+	void flush_old(double now) {
+		for (size_t d = 0; d < batches.size(); ++d)
+			if (!batches[d].empty() && now - since[d] >= latency)
+				flush(d);
+	}
+
+	uint64_t messages{0};
+
+private:
+	Sends<T>& sends;
+	const size_t size;
+	const size_t width;
+	const int tag;
+	const double latency;
+	std::vector<std::vector<T>> batches;
+	std::vector<double> since;  // when the first message of a batch was added
+};
+
+} // namespace comm
+
+#endif // COMM_HPP
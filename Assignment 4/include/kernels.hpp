@@ -0,0 +1,245 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+//
+// The computation of a request: A[c1][c2] and B[c2][c1] are filled from
+// the keys, C = A x B, and the result is the sum of the elements of C.
+//
+// The matrices live in contiguous 64-byte aligned buffers owned by the
+// calling thread and reused by all its requests. The product keeps a row
+// of C in registers, vectorized over its columns, while k runs along the
+// row of A: every element of C still adds its products in k order and the
+// elements are still summed row by row, so the result is bitwise the one
+// of the naive triple loop (reference()). The stream only asks for c1 ==
+// SIZE, so there is one kernel per c2 in [1, SIZE] with both sizes known
+// at compile time; the other shapes go through the generic kernel.
+//
+// fused() gets the same sum without the matrices: the sum of the elements
+// of A x B is the dot product of the column sums of A and the row sums of
+// B, which have a closed form. It is exact up to the final rounding, so it
+// differs from the float product by that product's rounding error; since
+// the master derives the next counts from the integer part of the results,
+// a run with fused() can then follow a different path. The verify mode
+// checks both kernels of every request against reference(): compute()
+// must match it bitwise, fused() within tolerance(); it keeps compute()'s
+// result.
+//
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <cfloat>
+#include <string>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <vector>
+
+const long SIZE = 64;
+
+namespace kernels {
+
+// 64-byte aligned floats, the buffer only grows
+class Buffer {
+
+public:
+	Buffer() = default;
+	~Buffer() { std::free(data); }
+
+	Buffer(const Buffer&) = delete;
+	Buffer& operator=(const Buffer&) = delete;
+
+	float* get(size_t n) {
+		if (n > capacity) {
+			std::free(data);
+			capacity = (n + 15) / 16 * 16;
+			data = static_cast<float*>(std::aligned_alloc(64, capacity * sizeof(float)));
+		}
+		return data;
+	}
+
+private:
+	float* data{nullptr};
+	size_t capacity{0};
+};
+
+// M[r][c] = (key - i - j) / SIZE, row major
+inline void fill(float* __restrict M, long rows, long cols, long key) {
+	for (long i = 0; i < rows; ++i)
+		for (long j = 0; j < cols; ++j)
+			M[i * cols + j] = (key - i - j) / static_cast<float>(SIZE);
+}
+
+// sum of the elements of A x B, A[C1][C2] B[C2][C1]
+template <long C1, long C2>
+float mm_fixed(const float* __restrict A, const float* __restrict B) {
+	float sum{0};
+	for (long i = 0; i < C1; ++i) {
+		alignas(64) float row[C1] = {};
+		for (long k = 0; k < C2; ++k) {
+			const float a = A[i * C2 + k];
+			for (long j = 0; j < C1; ++j)
+				row[j] += a * B[k * C1 + j];
+		}
+		for (long j = 0; j < C1; ++j)
+			sum += row[j];
+	}
+	return sum;
+}
+
+// same as mm_fixed for any shape, row holds c1 floats
+inline float mm_any(const float* __restrict A, const float* __restrict B, long c1, long c2, float* __restrict row) {
+	float sum{0};
+	for (long i = 0; i < c1; ++i) {
+		for (long j = 0; j < c1; ++j)
+			row[j] = 0;
+		for (long k = 0; k < c2; ++k) {
+			const float a = A[i * c2 + k];
+			for (long j = 0; j < c1; ++j)
+				row[j] += a * B[k * c1 + j];
+		}
+		for (long j = 0; j < c1; ++j)
+			sum += row[j];
+	}
+	return sum;
+}
+
+using Kernel = float (*)(const float*, const float*);
+
+template <size_t... C2>
+constexpr std::array<Kernel, sizeof...(C2)> make_table(std::index_sequence<C2...>) {
+	return {&mm_fixed<SIZE, C2 + 1>...};
+}
+
+// KERNELS[c2 - 1] multiplies A[SIZE][c2] by B[c2][SIZE]
+inline constexpr auto KERNELS = make_table(std::make_index_sequence<SIZE>{});
+
+inline float compute(long c1, long c2, long key1, long key2) {
+	thread_local Buffer a, b, row;
+	float* A = a.get(c1 * c2);
+	float* B = b.get(c2 * c1);
+	fill(A, c1, c2, key1);
+	fill(B, c2, c1, key2);
+	if (c1 == SIZE && c2 >= 1 && c2 <= SIZE)
+		return KERNELS[c2 - 1](A, B);
+	return mm_any(A, B, c1, c2, row.get(c1));
+}
+
+// the sum of A x B from the sums of the columns of A and of the rows of B,
+// in O(1): with T = c1 (c1 - 1) / 2,
+//   sum_i A[i][k] = (c1 (key1 - k) - T) / SIZE = (a - c1 k) / SIZE
+//   sum_j B[k][j] = (c1 (key2 - k) - T) / SIZE = (b - c1 k) / SIZE
+// and the sum over k of (a - c1 k)(b - c1 k) is computed exactly in integers
+inline float fused(long c1, long c2, long key1, long key2) {
+	using wide = __int128;
+	const wide t = static_cast<wide>(c1) * (c1 - 1) / 2;
+	const wide a = static_cast<wide>(c1) * key1 - t;
+	const wide b = static_cast<wide>(c1) * key2 - t;
+	const wide k1 = static_cast<wide>(c2) * (c2 - 1) / 2;              // sum of k
+	const wide k2 = static_cast<wide>(c2) * (c2 - 1) * (2 * c2 - 1) / 6;  // sum of k^2
+	const wide total = c2 * a * b - c1 * (a + b) * k1 + static_cast<wide>(c1) * c1 * k2;
+	return static_cast<float>(static_cast<long double>(total) / (SIZE * SIZE));
+}
+
+// bound on the error of the float product: an element of C adds c2
+// products and the sum adds c1 * c1 elements, so the error is below
+// (c2 + c1 * c1) * FLT_EPSILON / 2 times the sum of |A[i][k] * B[k][j]|
+inline double tolerance(long c1, long c2, long key1, long key2) {
+	double magnitude = 0;
+	for (long k = 0; k < c2; ++k) {
+		double a = 0, b = 0;
+		for (long i = 0; i < c1; ++i) {
+			a += std::fabs((key1 - i - k) / static_cast<double>(SIZE));
+			b += std::fabs((key2 - k - i) / static_cast<double>(SIZE));
+		}
+		magnitude += a * b;
+	}
+	return (c2 + c1 * c1) * FLT_EPSILON / 2 * magnitude;
+}
+
+enum class Mode { gemm, fused, verify };
+
+inline bool parse_mode(const std::string& name, Mode& mode) {
+	if (name == "gemm")
+		mode = Mode::gemm;
+	else if (name == "fused")
+		mode = Mode::fused;
+	else if (name == "verify")
+		mode = Mode::verify;
+	else
+		return false;
+	return true;
+}
+
+// the original computation, the reference of the verify mode
+inline float reference(long c1, long c2, long key1, long key2) {
+	std::vector<std::vector<float>> A(c1, std::vector<float>(c2, 0.0));
+	std::vector<std::vector<float>> B(c2, std::vector<float>(c1, 0.0));
+	for (long i = 0; i < c1; ++i)
+		for (long j = 0; j < c2; ++j)
+			A[i][j] = (key1 - i - j) / static_cast<float>(SIZE);
+	for (long i = 0; i < c2; ++i)
+		for (long j = 0; j < c1; ++j)
+			B[i][j] = (key2 - i - j) / static_cast<float>(SIZE);
+
+	float sum{0};
+	for (long i = 0; i < c1; i++) {
+		for (long j = 0; j < c1; j++) {
+			auto accum = float(0.0);
+			for (long k = 0; k < c2; k++)
+				accum += A[i][k] * B[k][j];
+			sum += accum;
+		}
+	}
+	return sum;
+}
+
+// the errors of one kernel against the reference
+struct Errors {
+	uint64_t failed{0};     // requests out of bounds
+	double worst{0};        // largest error / tolerance
+
+	void add(double error, double bound, bool exact) {
+		if (exact ? error != 0 : error > bound)
+			++failed;
+		if (bound > 0)
+			worst = std::max(worst, error / bound);
+	}
+
+	void merge(const Errors& o) {
+		failed += o.failed;
+		worst = std::max(worst, o.worst);
+	}
+};
+
+// what the verify mode has seen
+struct Check {
+	uint64_t checked{0};
+	Errors gemm;            // compute(), bitwise
+	Errors fused;           // fused(), within tolerance()
+
+	void merge(const Check& o) {
+		checked += o.checked;
+		gemm.merge(o.gemm);
+		fused.merge(o.fused);
+	}
+};
+
+// the result of a request with the chosen kernel
+inline float evaluate(Mode mode, long c1, long c2, long key1, long key2, Check& check) {
+	if (mode == Mode::gemm)
+		return compute(c1, c2, key1, key2);
+	if (mode == Mode::fused)
+		return fused(c1, c2, key1, key2);
+	const double expected = reference(c1, c2, key1, key2);
+	const double bound = tolerance(c1, c2, key1, key2);
+	const float r = compute(c1, c2, key1, key2);
+	++check.checked;
+	check.gemm.add(std::fabs(r - expected), bound, true);
+	check.fused.add(std::fabs(fused(c1, c2, key1, key2) - expected), bound, false);
+	return r;
+}
+
+} // namespace kernels
+
+#endif // KERNELS_HPP
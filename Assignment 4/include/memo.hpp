@@ -0,0 +1,97 @@
+#ifndef MEMO_HPP
+#define MEMO_HPP
+
+//
+// Memoization of the requests: compute() is a pure function of the tuple
+// (c1, c2, key1, key2), and with few keys the same tuples come back over
+// and over. The cache is bounded and evicts with the clock algorithm: a
+// hit sets the reference bit of the entry, the hand clears the bits it
+// passes and evicts the first entry found without one.
+//
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace memo {
+
+struct Key {
+	long c1, c2, key1, key2;
+
+	bool operator==(const Key& o) const {
+		return c1 == o.c1 && c2 == o.c2 && key1 == o.key1 && key2 == o.key2;
+	}
+};
+
+struct Hash {
+	size_t operator()(const Key& k) const {
+		uint64_t h = k.key1 * 0x9E3779B97F4A7C15ULL ^ k.key2 * 0xC2B2AE3D27D4EB4FULL;
+		h ^= (static_cast<uint64_t>(k.c1) << 32 | static_cast<uint64_t>(k.c2)) * 0x165667B19E3779F9ULL;
+		return h ^ (h >> 29);
+	}
+};
+
+class Cache {
+
+public:
+	// a capacity of 0 disables the cache
+	explicit Cache(size_t capacity = 0) : capacity(capacity) {
+		index.reserve(capacity);
+		entries.reserve(capacity);
+	}
+
+	bool enabled() const { return capacity > 0; }
+
+	bool find(const Key& k, float& r) {
+		if (capacity == 0)
+			return false;
+		++lookups;
+		auto it = index.find(k);
+		if (it == index.end())
+			return false;
+		Entry& e = entries[it->second];
+		e.referenced = true;
+		r = e.r;
+		++hits;
+		return true;
+	}
+
+	void insert(const Key& k, float r) {
+		if (capacity == 0 || index.count(k))
+			return;
+		if (entries.size() < capacity) {
+			index.emplace(k, entries.size());
+			entries.push_back({k, r, false});
+			return;
+		}
+		while (entries[hand].referenced) {
+			entries[hand].referenced = false;
+			hand = (hand + 1) % capacity;
+		}
+		index.erase(entries[hand].key);
+		index.emplace(k, hand);
+		entries[hand] = {k, r, false};
+		hand = (hand + 1) % capacity;
+		++evictions;
+	}
+
+	uint64_t lookups{0};
+	uint64_t hits{0};
+	uint64_t evictions{0};
+
+private:
+	struct Entry {
+		Key key;
+		float r;
+		bool referenced;
+	};
+
+	const size_t capacity;
+	std::unordered_map<Key, size_t, Hash> index;
+	std::vector<Entry> entries;
+	size_t hand{0};
+};
+
+} // namespace memo
+
+#endif // MEMO_HPP
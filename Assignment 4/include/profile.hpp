@@ -0,0 +1,352 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+//
+// Communication timeline of nkeyspar through the PMPI interface: the MPI
+// calls of the program go through the wrappers below, which time them and
+// call the PMPI version. Nothing is recorded unless NKEYSPAR_PROFILE names
+// a file in the environment of rank 0 at launch, e.g.
+//   mpirun -n 4 -x NKEYSPAR_PROFILE=run.json ./nkeyspar 100 1000000
+// then every rank keeps, in memory, its sends and completed receives
+// (peer, tag, bytes), its blocking waits, its collectives and the compute
+// regions marked with profile::Region. At MPI_Finalize the ranks append
+// their events in turn to the file, in the Chrome trace format (open it
+// in Perfetto or chrome://tracing, a rank is a process), and rank 0
+// prints the time per category of every rank.
+//
+// The wrappers are definitions of the MPI functions: the header goes in
+// one translation unit of the program, and only the thread that calls MPI
+// may open a Region.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mpi.h>
+
+namespace profile {
+
+enum Kind { SEND, RECV, WAIT, COLLECTIVE, COMPUTE, KINDS };
+const char* const NAMES[KINDS] = {"send", "recv", "wait", "collective", "compute"};
+
+struct Event {
+	double begin, end;
+	int kind, peer, tag;
+	long bytes;
+};
+
+struct State {
+	bool on{false};
+	int rank{0};
+	int nranks{1};
+	double t0{0};
+	std::string path;
+	std::vector<Event> events;
+	std::unordered_map<MPI_Request, double> receives;   // posted, when
+	std::vector<MPI_Request> handles;   // of the requests being completed
+	std::vector<MPI_Status> statuses;
+};
+
+inline State state;
+
+inline void record(int kind, double begin, double end, int peer = -1, int tag = -1, long bytes = 0) {
+	state.events.push_back({begin, end, kind, peer, tag, bytes});
+}
+
+inline long bytes(int count, MPI_Datatype type) {
+	int size;
+	PMPI_Type_size(type, &size);
+	return static_cast<long>(count) * size;
+}
+
+// a receive has completed with status: request is its handle before the
+// completion, the other requests are not receives
+inline void completed(MPI_Request request, const MPI_Status& status, double now) {
+	auto it = state.receives.find(request);
+	if (it == state.receives.end())
+		return;
+	int n = 0;
+	PMPI_Get_count(&status, MPI_BYTE, &n);
+	record(RECV, it->second, now, status.MPI_SOURCE, status.MPI_TAG, n);
+	state.receives.erase(it);
+}
+
+// a region of the program, compute by default
+class Region {
+
+public:
+	explicit Region(int kind = COMPUTE) : kind(kind), begin(state.on ? PMPI_Wtime() : 0) {}
+	~Region() {
+		if (state.on)
+			record(kind, begin, PMPI_Wtime());
+	}
+
+	Region(const Region&) = delete;
+	Region& operator=(const Region&) = delete;
+
+private:
+	const int kind;
+	const double begin;
+};
+
+// after MPI_Init: rank 0 decides, the clocks start together
+inline void start() {
+	PMPI_Comm_rank(MPI_COMM_WORLD, &state.rank);
+	PMPI_Comm_size(MPI_COMM_WORLD, &state.nranks);
+	char path[4096] = {};
+	if (state.rank == 0)
+		if (const char* env = std::getenv("NKEYSPAR_PROFILE"))
+			std::snprintf(path, sizeof(path), "%s", env);
+	PMPI_Bcast(path, sizeof(path), MPI_CHAR, 0, MPI_COMM_WORLD);
+	if (path[0] == '\0')
+		return;
+	state.path = path;
+	state.events.reserve(1 << 16);
+	PMPI_Barrier(MPI_COMM_WORLD);
+	state.t0 = PMPI_Wtime();
+	state.on = true;
+}
+
+// before MPI_Finalize: the summary, then the trace
+inline void finish() {
+	if (!state.on)
+		return;
+	state.on = false;
+	const double end = PMPI_Wtime();
+
+	// seconds per kind, the total, then messages and bytes out and in
+	enum { TOTAL = KINDS, SENT, SENT_BYTES, RECEIVED, RECEIVED_BYTES, FIELDS };
+	double mine[FIELDS] = {};
+	for (const auto& e : state.events) {
+		mine[e.kind] += e.end - e.begin;
+		if (e.kind == SEND) {
+			mine[SENT] += 1;
+			mine[SENT_BYTES] += e.bytes;
+		} else if (e.kind == RECV) {
+			mine[RECEIVED] += 1;
+			mine[RECEIVED_BYTES] += e.bytes;
+		}
+	}
+	mine[RECV] = 0;     // a receive spans from its post to its completion
+	mine[TOTAL] = end - state.t0;
+	std::vector<double> all(FIELDS * state.nranks);
+	PMPI_Gather(mine, FIELDS, MPI_DOUBLE, all.data(), FIELDS, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if (state.rank == 0) {
+		std::printf("%6s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "rank", "total (s)", "compute",
+					"wait", "collective", "send", "other", "msgs out", "MB out", "msgs in", "MB in");
+		for (int r = 0; r < state.nranks; ++r) {
+			const double* t = &all[FIELDS * r];
+			const double other = t[TOTAL] - t[COMPUTE] - t[WAIT] - t[COLLECTIVE] - t[SEND];
+			std::printf("%6d %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f %10.0f %10.3f %10.0f %10.3f\n", r, t[TOTAL],
+						t[COMPUTE], t[WAIT], t[COLLECTIVE], t[SEND], other, t[SENT], t[SENT_BYTES] / 1e6,
+						t[RECEIVED], t[RECEIVED_BYTES] / 1e6);
+		}
+		std::fflush(stdout);
+	}
+
+	// the ranks append their events in turn
+	int token = 0;
+	if (state.rank > 0)
+		PMPI_Recv(&token, 1, MPI_INT, state.rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	if (FILE* f = std::fopen(state.path.c_str(), state.rank == 0 ? "w" : "a")) {
+		std::fprintf(f, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}}",
+					 state.rank == 0 ? "[\n" : ",\n", state.rank, state.rank);
+		for (const auto& e : state.events) {
+			const double ts = (e.begin - state.t0) * 1e6;
+			const double dur = (e.end - e.begin) * 1e6;
+			if (e.kind == SEND || e.kind == RECV)
+				// a message, at its send or at its arrival
+				std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":0,"
+							 "\"args\":{\"peer\":%d,\"tag\":%d,\"bytes\":%ld,\"%s_us\":%.3f}}",
+							 NAMES[e.kind], NAMES[e.kind], e.kind == SEND ? ts : ts + dur, state.rank, e.peer, e.tag,
+							 e.bytes, e.kind == SEND ? "call" : "posted", dur);
+			else
+				std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":0}",
+							 NAMES[e.kind], NAMES[e.kind], ts, dur, state.rank);
+		}
+		if (state.rank == state.nranks - 1)
+			std::fprintf(f, "\n]\n");
+		std::fclose(f);
+	} else
+		std::printf("ERROR: opening file %s\n", state.path.c_str());
+	if (state.rank < state.nranks - 1)
+		PMPI_Send(&token, 1, MPI_INT, state.rank + 1, 0, MPI_COMM_WORLD);
+}
+
+// the status of a completion, the caller's or a local one
+inline MPI_Status* statuses(int count) {
+	if (state.statuses.size() < static_cast<size_t>(count))
+		state.statuses.resize(count);
+	return state.statuses.data();
+}
+
+} // namespace profile
+
+extern "C" {
+
+int MPI_Init(int* argc, char*** argv) {
+	const int rc = PMPI_Init(argc, argv);
+	profile::start();
+	return rc;
+}
+
+int MPI_Init_thread(int* argc, char*** argv, int required, int* provided) {
+	const int rc = PMPI_Init_thread(argc, argv, required, provided);
+	profile::start();
+	return rc;
+}
+
+int MPI_Finalize() {
+	profile::finish();
+	return PMPI_Finalize();
+}
+
+int MPI_Send(const void* buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Send(buf, count, type, dest, tag, comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Send(buf, count, type, dest, tag, comm);
+	profile::record(profile::SEND, begin, PMPI_Wtime(), dest, tag, profile::bytes(count, type));
+	return rc;
+}
+
+int MPI_Isend(const void* buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request* request) {
+	if (!profile::state.on)
+		return PMPI_Isend(buf, count, type, dest, tag, comm, request);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Isend(buf, count, type, dest, tag, comm, request);
+	profile::record(profile::SEND, begin, PMPI_Wtime(), dest, tag, profile::bytes(count, type));
+	return rc;
+}
+
+int MPI_Irecv(void* buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Request* request) {
+	const int rc = PMPI_Irecv(buf, count, type, source, tag, comm, request);
+	if (profile::state.on)
+		profile::state.receives[*request] = PMPI_Wtime();
+	return rc;
+}
+
+int MPI_Recv(void* buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Status* status) {
+	if (!profile::state.on)
+		return PMPI_Recv(buf, count, type, source, tag, comm, status);
+	MPI_Status local;
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Recv(buf, count, type, source, tag, comm, &local);
+	const double end = PMPI_Wtime();
+	int n = 0;
+	PMPI_Get_count(&local, MPI_BYTE, &n);
+	profile::record(profile::WAIT, begin, end);
+	profile::record(profile::RECV, begin, end, local.MPI_SOURCE, local.MPI_TAG, n);
+	if (status != MPI_STATUS_IGNORE)
+		*status = local;
+	return rc;
+}
+
+int MPI_Cancel(MPI_Request* request) {
+	if (profile::state.on)
+		profile::state.receives.erase(*request);
+	return PMPI_Cancel(request);
+}
+
+int MPI_Wait(MPI_Request* request, MPI_Status* status) {
+	if (!profile::state.on)
+		return PMPI_Wait(request, status);
+	const MPI_Request handle = *request;
+	MPI_Status local;
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Wait(request, &local);
+	const double end = PMPI_Wtime();
+	profile::record(profile::WAIT, begin, end);
+	profile::completed(handle, local, end);
+	if (status != MPI_STATUS_IGNORE)
+		*status = local;
+	return rc;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[]) {
+	if (!profile::state.on)
+		return PMPI_Waitall(count, requests, statuses);
+	auto& handles = profile::state.handles;
+	handles.assign(requests, requests + count);
+	MPI_Status* local = profile::statuses(count);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Waitall(count, requests, local);
+	const double end = PMPI_Wtime();
+	profile::record(profile::WAIT, begin, end);
+	for (int i = 0; i < count; ++i) {
+		profile::completed(handles[i], local[i], end);
+		if (statuses != MPI_STATUSES_IGNORE)
+			statuses[i] = local[i];
+	}
+	return rc;
+}
+
+int MPI_Testsome(int incount, MPI_Request requests[], int* outcount, int indices[], MPI_Status statuses[]) {
+	if (!profile::state.on)
+		return PMPI_Testsome(incount, requests, outcount, indices, statuses);
+	auto& handles = profile::state.handles;
+	handles.assign(requests, requests + incount);
+	MPI_Status* local = profile::statuses(incount);
+	const int rc = PMPI_Testsome(incount, requests, outcount, indices, local);
+	if (*outcount == MPI_UNDEFINED || *outcount == 0)
+		return rc;
+	const double now = PMPI_Wtime();
+	for (int i = 0; i < *outcount; ++i) {
+		profile::completed(handles[indices[i]], local[i], now);
+		if (statuses != MPI_STATUSES_IGNORE)
+			statuses[i] = local[i];
+	}
+	return rc;
+}
+
+int MPI_Barrier(MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Barrier(comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Barrier(comm);
+	profile::record(profile::COLLECTIVE, begin, PMPI_Wtime());
+	return rc;
+}
+
+int MPI_Bcast(void* buf, int count, MPI_Datatype type, int root, MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Bcast(buf, count, type, root, comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Bcast(buf, count, type, root, comm);
+	profile::record(profile::COLLECTIVE, begin, PMPI_Wtime(), root, -1, profile::bytes(count, type));
+	return rc;
+}
+
+int MPI_Reduce(const void* sendbuf, void* recvbuf, int count, MPI_Datatype type, MPI_Op op, int root, MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Reduce(sendbuf, recvbuf, count, type, op, root, comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Reduce(sendbuf, recvbuf, count, type, op, root, comm);
+	profile::record(profile::COLLECTIVE, begin, PMPI_Wtime(), root, -1, profile::bytes(count, type));
+	return rc;
+}
+
+int MPI_Allreduce(const void* sendbuf, void* recvbuf, int count, MPI_Datatype type, MPI_Op op, MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Allreduce(sendbuf, recvbuf, count, type, op, comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Allreduce(sendbuf, recvbuf, count, type, op, comm);
+	profile::record(profile::COLLECTIVE, begin, PMPI_Wtime(), -1, -1, profile::bytes(count, type));
+	return rc;
+}
+
+int MPI_Gather(const void* sendbuf, int sendcount, MPI_Datatype sendtype, void* recvbuf, int recvcount,
+			   MPI_Datatype recvtype, int root, MPI_Comm comm) {
+	if (!profile::state.on)
+		return PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+	const double begin = PMPI_Wtime();
+	const int rc = PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+	profile::record(profile::COLLECTIVE, begin, PMPI_Wtime(), root, -1, profile::bytes(sendcount, sendtype));
+	return rc;
+}
+
+} // extern "C"
+
+#endif // PROFILE_HPP
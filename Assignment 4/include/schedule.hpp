@@ -0,0 +1,62 @@
+#ifndef SCHEDULE_HPP
+#define SCHEDULE_HPP
+
+//
+// Demand-driven choice of the worker of a request: every worker has at
+// most 'credits' requests outstanding, a request goes to the worker with
+// the most free credits (the first one after the last choice on a tie),
+// and a result gives the credit back. A slow request then only delays the
+// worker computing it, instead of every request assigned after it.
+//
+
+#include <vector>
+#include <algorithm>
+
+namespace schedule {
+
+class Credits {
+
+public:
+	// workers are the ranks first .. nranks - 1, first > 0
+	Credits(int first, int nranks, long credits) :
+		credits(credits), outstanding(nranks), requests(nranks), depth_sum(nranks), max_depth(nranks),
+		first(first), last(first - 1) {}
+
+	// the rank of the next request, 0 when every worker is out of credits
+	int pick() {
+		const int n = outstanding.size() - first;
+		int best = 0;
+		for (int i = 1; i <= n; ++i) {
+			const int w = first + (last - first + i) % n;
+			if (outstanding[w] < credits && (best == 0 || outstanding[w] < outstanding[best]))
+				best = w;
+		}
+		if (best != 0)
+			last = best;
+		return best;
+	}
+
+	void sent(int w) {
+		++outstanding[w];
+		++requests[w];
+		depth_sum[w] += outstanding[w];
+		max_depth[w] = std::max(max_depth[w], outstanding[w]);
+	}
+
+	void returned(int w) { --outstanding[w]; }
+
+	const long credits;
+	std::vector<long> outstanding;
+	// per worker: requests sent, their queue depth when sent, the largest one
+	std::vector<long> requests;
+	std::vector<long> depth_sum;
+	std::vector<long> max_depth;
+
+private:
+	const int first;
+	int last;
+};
+
+} // namespace schedule
+
+#endif // SCHEDULE_HPP
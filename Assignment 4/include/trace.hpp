@@ -0,0 +1,164 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+//
+// The stream of key pairs: generated as always (std::mt19937 with seed
+// 117), or replayed from a trace. A trace is a header, the magic
+// "NKTRACE1" then the number of keys and of pairs as uint64, followed by
+// the pairs, two uint32 each, in the byte order of the machine. A file is
+// mapped in memory and its pairs are read in place, the standard input
+// ("-") is read in blocks: a pair is two loads, no parsing, so a replay
+// is cheaper than the generator. The number of keys of a trace cannot
+// exceed the one of the stream, and every key is checked against it, so a
+// corrupted or truncated trace stops the replay with an error (failed())
+// instead of indexing past the tables; the stream still makes the two keys
+// of a pair distinct, as it does with the generated ones.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace trace {
+
+const char MAGIC[8] = {'N', 'K', 'T', 'R', 'A', 'C', 'E', '1'};
+
+struct Header {
+	char magic[8];
+	uint64_t nkeys;
+	uint64_t length;
+};
+
+// the original generator, a value in [min, max] at every call
+class Generator {
+
+public:
+	long operator()(long min, long max) {
+		std::uniform_int_distribution<long> distribution(min, max);
+		return distribution(generator);
+	}
+
+private:
+	std::mt19937 generator{117};
+};
+
+class Source {
+
+public:
+	// the generated stream of nkeys keys, until open() is called
+	explicit Source(long nkeys) : nkeys(nkeys) {}
+
+	~Source() {
+		if (base != MAP_FAILED)
+			::munmap(base, size);
+		if (fd > 0)
+			::close(fd);
+	}
+
+	Source(const Source&) = delete;
+	Source& operator=(const Source&) = delete;
+
+	// replays the trace in path, or on the standard input when path is "-";
+	// its keys must be below the nkeys of the stream
+	bool open(const std::string& path) {
+		Header header;
+		if (path == "-") {
+			fd = 0;
+			if (std::fread(&header, sizeof(header), 1, stdin) != 1)
+				return error("reading the standard input");
+		} else {
+			fd = ::open(path.c_str(), O_RDONLY);
+			struct stat sb;
+			if (fd < 0 || ::fstat(fd, &sb) != 0 || static_cast<size_t>(sb.st_size) < sizeof(header))
+				return error(("opening file " + path).c_str());
+			size = sb.st_size;
+			base = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (base == MAP_FAILED)
+				return error(("mapping file " + path).c_str());
+			::madvise(base, size, MADV_SEQUENTIAL);
+			::madvise(base, size, MADV_WILLNEED);
+			std::memcpy(&header, base, sizeof(header));
+		}
+		if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+			return error("not a trace");
+		if (header.nkeys > static_cast<uint64_t>(nkeys))
+			return error("the trace has more keys than the stream");
+		limit = header.nkeys;
+		remaining = header.length;
+		if (fd == 0)
+			block.resize(2 << 16);
+		else {
+			if ((size - sizeof(header)) / (2 * sizeof(uint32_t)) < remaining)
+				return error("the trace is truncated");
+			pair = reinterpret_cast<const uint32_t*>(static_cast<const char*>(base) + sizeof(header));
+		}
+		replay = true;
+		return true;
+	}
+
+	// the next pair, false at the end of the trace or on an error
+	bool next(long& key1, long& key2) {
+		if (!replay) {
+			key1 = generator(0, nkeys - 1);
+			key2 = generator(0, nkeys - 1);
+			return true;
+		}
+		if (remaining == 0)
+			return false;
+		if (fd == 0 && pair == end && !refill())
+			return fail("the trace is truncated");
+		if (pair[0] >= limit || pair[1] >= limit)
+			return fail("a key of the trace is out of range");
+		key1 = pair[0];
+		key2 = pair[1];
+		pair += 2;
+		--remaining;
+		return true;
+	}
+
+	// the replay stopped on a bad pair
+	bool failed() const { return broken; }
+
+private:
+	bool fail(const char* what) {
+		broken = true;
+		return error(what);
+	}
+
+	bool error(const char* what) {
+		std::printf("ERROR: %s\n", what);
+		return false;
+	}
+
+	// the next block of pairs from the standard input
+	bool refill() {
+		const size_t n = std::fread(block.data(), 2 * sizeof(uint32_t), block.size() / 2, stdin);
+		pair = block.data();
+		end = pair + 2 * n;
+		return n > 0;
+	}
+
+	const long nkeys;
+	Generator generator;
+	bool replay{false};
+	bool broken{false};
+	uint64_t limit{0};      // number of keys of the trace
+	int fd{-1};
+	void* base{MAP_FAILED};
+	size_t size{0};
+	uint64_t remaining{0};
+	const uint32_t* pair{nullptr};
+	const uint32_t* end{nullptr};
+	std::vector<uint32_t> block;
+};
+
+} // namespace trace
+
+#endif // TRACE_HPP
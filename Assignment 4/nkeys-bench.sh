@@ -0,0 +1,100 @@
+#!/bin/sh
+
+# Local scaling and verification suite for nkeyspar, on a single machine
+# with mpirun instead of the cluster's srun (see nkeys.sh):
+#   make nkeys nkeyspar && ./nkeys-bench.sh [results.csv]
+#
+# For every number of keys and stream length, ./nkeys gives the reference
+# values and the sequential time, then nkeyspar runs with every number of
+# processes (strong scaling). The weak scaling study keeps the keys and
+# gives every worker WEAK_LENGTH pairs. Every parallel V is compared with
+# the reference, key by key, within a relative TOLERANCE.
+#
+# The settings come from the environment, e.g.
+#   KEYS="2 100" PROCS="2 4 8" MPIRUN="mpirun --oversubscribe" ./nkeys-bench.sh
+#
+# CSV columns: study, keys, length, procs, seq_time, par_time, speedup,
+# efficiency (speedup over the workers, procs - 1; for the weak study the
+# sequential time of WEAK_LENGTH over the parallel time), max_rel_error, ok
+
+KEYS=${KEYS:-"2 100 500"}
+LENGTHS=${LENGTHS:-"1000000"}
+PROCS=${PROCS:-"2 3 5 9"}
+WEAK_KEYS=${WEAK_KEYS:-100}
+WEAK_LENGTH=${WEAK_LENGTH:-250000}
+TOLERANCE=${TOLERANCE:-1e-6}
+MPIRUN=${MPIRUN:-mpirun}
+NKEYSPAR_OPTS=${NKEYSPAR_OPTS:-}
+OUT=${1:-nkeys-bench.csv}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+elapsed() {
+    sed -n 's/^Elapsed time: \([0-9.]*\),.*/\1/p' "$1"
+}
+
+# largest relative error of the values in $1 against the reference $2,
+# "missing" when a key is missing
+compare() {
+    awk '$1 == "key" { if (FNR == NR) v[$2] = $4; else r[$2] = $4 }
+         END {
+             worst = 0
+             for (k in r) {
+                 if (!(k in v)) { print "missing"; exit }
+                 d = v[k] - r[k]; if (d < 0) d = -d
+                 m = r[k] < 0 ? -r[k] : r[k]; if (m < 1) m = 1
+                 if (d / m > worst) worst = d / m
+             }
+             printf "%g\n", worst
+         }' "$1" "$2"
+}
+
+# runs the reference of keys $1 and length $2 into $TMP/ref
+reference() {
+    ./nkeys "$1" "$2" 1 > "$TMP/ref" && elapsed "$TMP/ref"
+}
+
+# runs nkeyspar on $1 processes, keys $2, length $3, writes a CSV line
+# with the study $4, the sequential time $5 and the base time $6
+parallel() {
+    $MPIRUN -n "$1" ./nkeyspar $NKEYSPAR_OPTS "$2" "$3" 1 > "$TMP/par" 2> "$TMP/err"
+    tp=$(elapsed "$TMP/par")
+    if [ -z "$tp" ]; then
+        echo "$4,$2,$3,$1,$5,,,,,failed" >> "$OUT"
+        echo "FAILED: $MPIRUN -n $1 ./nkeyspar $NKEYSPAR_OPTS $2 $3" >&2
+        return
+    fi
+    err=$(compare "$TMP/par" "$TMP/ref")
+    awk -v study="$4" -v k="$2" -v l="$3" -v p="$1" -v ts="$5" -v tb="$6" -v tp="$tp" -v err="$err" -v tol="$TOLERANCE" 'BEGIN {
+        speedup = ts / tp
+        efficiency = (study == "weak") ? tb / tp : speedup / (p - 1)
+        ok = (err != "missing" && err + 0 <= tol + 0) ? "yes" : "no"
+        printf "%s,%s,%s,%s,%f,%f,%.3f,%.3f,%s,%s\n", study, k, l, p, ts, tp, speedup, efficiency, err, ok
+    }' >> "$OUT"
+    tail -n 1 "$OUT"
+}
+
+echo "study,keys,length,procs,seq_time,par_time,speedup,efficiency,max_rel_error,ok" > "$OUT"
+
+for k in $KEYS; do
+    for l in $LENGTHS; do
+        ts=$(reference "$k" "$l") || exit 1
+        for p in $PROCS; do
+            parallel "$p" "$k" "$l" strong "$ts" "$ts"
+        done
+    done
+done
+
+tb=$(reference "$WEAK_KEYS" "$WEAK_LENGTH") || exit 1
+for p in $PROCS; do
+    l=$((WEAK_LENGTH * (p - 1)))
+    ts=$(reference "$WEAK_KEYS" "$l") || exit 1
+    parallel "$p" "$WEAK_KEYS" "$l" weak "$ts" "$tb"
+done
+
+if grep -q ',no$\|,failed$' "$OUT"; then
+    echo "some runs do not match the reference, see $OUT" >&2
+    exit 1
+fi
+echo "all runs match the reference, see $OUT"
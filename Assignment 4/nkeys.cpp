@@ -0,0 +1,115 @@
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <kernels.hpp>
+#include <trace.hpp>
+// g++ -std=c++20 -O3 -I include/ -o nkeys nkeys.cpp   (or make nkeys)
+// ./nkeys 100 1000000 1
+
+// Sequential reference of nkeyspar, with the same stream and bitwise the
+// same values. A request is computed as soon as it is made, but its result
+// is added once both keys of the pair have been checked: in nkeyspar the
+// result comes back before its key is used again, and the second key of the
+// pair is checked with the count of the first one before any reset.
+
+int main(int argc, char *argv[])
+{
+	auto usage = [argv]()
+	{
+		std::printf("use: %s [--trace file|-] nkeys length [print(0|1)]\n", argv[0]);
+		std::printf("     --trace: the pairs of a trace written by nkeystrace instead of the generator\n");
+		std::printf("     print: 0 disabled, 1 enabled\n");
+		return -1;
+	};
+
+	std::string trace_path;
+	int arg = 1;
+	for (; arg + 1 < argc && std::strncmp(argv[arg], "--", 2) == 0; arg += 2)
+	{
+		if (std::string(argv[arg]) != "--trace")
+			return usage();
+		trace_path = argv[arg + 1];
+	}
+	if (argc - arg < 2)
+		return usage();
+
+	long nkeys = std::stol(argv[arg]); // total number of keys
+	// length is the "stream length", i.e. the number of random key pairs generated
+	long length = std::stol(argv[arg + 1]);
+	bool print = false;
+	if (argc - arg == 3)
+		print = (std::stoi(argv[arg + 2]) == 1) ? true : false;
+
+	std::vector<long> map(nkeys, 0);
+	std::vector<float> V(nkeys, 0);
+
+	trace::Source stream(nkeys);
+	if (!trace_path.empty() && !stream.open(trace_path))
+		return -1;
+
+	// resets the count of key after its result
+	auto apply = [&](long key, float r1)
+	{
+		V[key] += r1;
+		auto _r1 = static_cast<unsigned long>(r1) % SIZE;
+		map[key] = (_r1 > (SIZE / 2)) ? 0 : _r1;
+	};
+
+	auto start = std::chrono::steady_clock::now();
+
+	long key1, key2, i = 0;
+	for (; i < length && stream.next(key1, key2); ++i)
+	{
+		if (key1 == key2) // only distinct values in the pair
+			key1 = (key1 + 1) % nkeys;
+
+		map[key1]++; // count the number of key1 keys
+		map[key2]++; // count the number of key2 keys
+
+		bool first = false, second = false;
+		float r1 = 0, r2 = 0;
+		if (map[key1] == SIZE && map[key2] != 0)
+		{
+			r1 = kernels::compute(map[key1], map[key2], key1, key2);
+			first = true;
+		}
+		if (map[key2] == SIZE && map[key1] != 0)
+		{
+			r2 = kernels::compute(map[key2], map[key1], key2, key1);
+			second = true;
+		}
+		if (first)
+			apply(key1, r1);
+		if (second)
+			apply(key2, r2);
+	}
+	if (stream.failed())
+		return -1;
+	length = i;
+
+	// compute the last values
+	for (long i = 0; i < nkeys; ++i)
+	{
+		for (long j = 0; j < nkeys; ++j)
+		{
+			if (i == j) continue;
+			if (map[i] > 0 && map[j] > 0)
+			{
+				V[i] += kernels::compute(map[i], map[j], i, j);
+				V[j] += kernels::compute(map[j], map[i], j, i);
+			}
+		}
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::printf("Elapsed time: %f, keys= %ld, length=%ld\n", elapsed.count(), nkeys, length);
+
+	if (print)
+	{
+		for (long i = 0; i < nkeys; ++i)
+			std::printf("key %ld : %f\n", i, V[i]);
+	}
+	return 0;
+}
@@ -1,11 +1,16 @@
 #include <cstdio>
-#include <random>
-#include <map>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <mpi.h>
-
-const long SIZE = 64;
+#include <omp.h>
+#include <kernels.hpp>
+#include <memo.hpp>
+#include <comm.hpp>
+#include <schedule.hpp>
+#include <trace.hpp>
+#include <profile.hpp>
+#include <deque>
 
 struct Result
 {
@@ -13,94 +18,110 @@ struct Result
 	float r;
 };
 
-long random(const int &min, const int &max)
-{
-	static std::mt19937 generator(117);
-	std::uniform_int_distribution<long> distribution(min, max);
-	return distribution(generator);
-};
-
-void init(auto &M, const long c1, const long c2, const long key)
-{
-	for (long i = 0; i < c1; ++i)
-		for (long j = 0; j < c2; ++j)
-			M[i][j] = (key - i - j) / static_cast<float>(SIZE);
-}
-
-// matrix multiplication:  C = A x B  A[c1][c2] B[c2][c1] C[c1][c1]
-// mm returns the sum of the elements of the C matrix
-auto mm(const auto &A, const auto &B, const long c1, const long c2)
-{
-	float sum{0};
-	for (long i = 0; i < c1; i++)
-	{
-		for (long j = 0; j < c1; j++)
-		{
-			auto accum = float(0.0);
-			for (long k = 0; k < c2; k++)
-			{
-				accum += A[i][k] * B[k][j];
-			}
-			sum += accum;
-		}
-	}
-	return sum;
-}
-
-// initialize two matrices with the computed values of the keys
-// and execute a matrix multiplication between the two matrices
-// to obtain the sum of the elements of the result matrix
-float compute(const long c1, const long c2, long key1, long key2)
-{
-
-	std::vector<std::vector<float>> A(c1, std::vector<float>(c2, 0.0));
-	std::vector<std::vector<float>> B(c2, std::vector<float>(c1, 0.0));
-
-	init(A, c1, c2, key1);
-	init(B, c2, c1, key2);
-	auto r = mm(A, B, c1, c2);
-	return r;
-}
-
 int main(int argc, char *argv[])
 {
-	if (argc < 3)
+	auto usage = [argv]()
 	{
-		std::printf("use: %s nkeys length [print(0|1)]\n", argv[0]);
+		std::printf("use: %s [--kernel gemm|fused|verify] [--cache n] [--master-cache n] [--credits n] [--batch n] [--flush us] [--threads n] [--coordinators n] [--park n] [--trace file|-] nkeys length [print(0|1)]\n", argv[0]);
+		std::printf("     --kernel: gemm computes the product (default), fused its closed form,\n");
+		std::printf("               verify checks the product and the closed form against the reference and keeps the product\n");
+		std::printf("     --cache: results remembered by every worker, 0 (default) disables the cache\n");
+		std::printf("     --master-cache: results remembered by the master, a hit sends no request\n");
+		std::printf("     --credits: requests outstanding on a worker at most, by default 4 or twice the batch,\n");
+		std::printf("                times the threads\n");
+		std::printf("     --batch: requests sent to a worker in one message at most, 1 (default) sends each one\n");
+		std::printf("     --flush: microseconds a request waits for its batch to fill at most, 100 by default\n");
+		std::printf("     --threads: threads computing the requests of every worker, 1 by default\n");
+		std::printf("     --coordinators: ranks sharing the keys of the stream, 1 by default\n");
+		std::printf("     --park: pairs with a pending key set aside while the stream goes on, at most;\n");
+		std::printf("             0 (default) waits for the key, needs a single coordinator\n");
+		std::printf("     --trace: the pairs of a trace written by nkeystrace instead of the generator, at most\n");
+		std::printf("              length of them; - reads the standard input and needs a single coordinator\n");
 		std::printf("     print: 0 disabled, 1 enabled\n");
+		std::printf("     NKEYSPAR_PROFILE=file in the environment writes the timeline of the run to file\n");
 		return -1;
+	};
+
+	// the options come first, each one with its value
+	kernels::Mode mode = kernels::Mode::gemm;
+	long cache_size = 0;
+	long master_cache_size = 0;
+	long credits = 0;
+	long batch = 1;
+	double flush_us = 100;
+	long threads = 1;
+	long coordinators = 1;
+	long park = 0;
+	std::string trace_path;
+	int arg = 1;
+	for (; arg + 1 < argc && std::strncmp(argv[arg], "--", 2) == 0; arg += 2)
+	{
+		std::string name = argv[arg];
+		if (name == "--kernel" && kernels::parse_mode(argv[arg + 1], mode))
+			continue;
+		if (name == "--cache" && (cache_size = std::stol(argv[arg + 1])) >= 0)
+			continue;
+		if (name == "--master-cache" && (master_cache_size = std::stol(argv[arg + 1])) >= 0)
+			continue;
+		if (name == "--credits" && (credits = std::stol(argv[arg + 1])) > 0)
+			continue;
+		if (name == "--batch" && (batch = std::stol(argv[arg + 1])) > 0)
+			continue;
+		if (name == "--flush" && (flush_us = std::stod(argv[arg + 1])) >= 0)
+			continue;
+		if (name == "--threads" && (threads = std::stol(argv[arg + 1])) > 0)
+			continue;
+		if (name == "--coordinators" && (coordinators = std::stol(argv[arg + 1])) > 0)
+			continue;
+		if (name == "--park" && (park = std::stol(argv[arg + 1])) >= 0)
+			continue;
+		if (name == "--trace")
+		{
+			trace_path = argv[arg + 1];
+			continue;
+		}
+		return usage();
 	}
+	if (argc - arg < 2 || (park > 0 && coordinators > 1) || (trace_path == "-" && coordinators > 1))
+		return usage();
+	if (credits == 0)
+		credits = std::max(4L, 2 * batch) * threads;
 
-	long nkeys = std::stol(argv[1]); // total number of keys
+	long nkeys = std::stol(argv[arg]); // total number of keys
 	// length is the "stream length", i.e. the number of random key pairs generated
-	long length = std::stol(argv[2]);
+	// (or read from the trace)
+	long length = std::stol(argv[arg + 1]);
 	bool print = false;
-	if (argc == 4)
-		print = (std::stoi(argv[3]) == 1) ? true : false;
+	if (argc - arg == 3)
+		print = (std::stoi(argv[arg + 2]) == 1) ? true : false;
 
 	long key1, key2;
 
-	std::map<long, long> map;
-	for (long i = 0; i < nkeys; ++i)
-		map[i] = 0;
-
-	// define a map to keep pending request
-	std::map<long, bool> pending;
-	for (long i = 0; i < nkeys; ++i)
-		pending[i] = false;
+	// the count of every key, and whether it has a pending request
+	std::vector<long> map(nkeys, 0);
+	std::vector<char> pending(nkeys, false);
 
 	std::vector<float> V(nkeys, 0);
 
 	int myrank;
 	int numP;
 
-	MPI_Init(&argc, &argv);
+	// the threads of a worker only compute, MPI is called by the main thread
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
 	MPI_Comm_size(MPI_COMM_WORLD, &numP);
 
-	if (numP < 2)
+	if (provided < MPI_THREAD_FUNNELED && threads > 1)
 	{
-		std::printf("At least 2 processes are required\n");
+		std::printf("The MPI library does not support threads\n");
+		MPI_Finalize();
+		return -1;
+	}
+
+	if (numP < coordinators + 1)
+	{
+		std::printf("At least %ld processes are required\n", coordinators + 1);
 		MPI_Finalize();
 		return -1;
 	}
@@ -118,130 +139,472 @@ int main(int argc, char *argv[])
 	MPI_Type_create_struct(2, blocklen, displs, oldtypes, &RESULT_T);
 	MPI_Type_commit(&RESULT_T);
 
+	// lookups, hits and evictions of the caches
+	uint64_t master_stats[3] = {0, 0, 0};
+	uint64_t worker_stats[3] = {0, 0, 0};
+
+	// requests computed and seconds spent computing by a worker, and the
+	// queue depths seen by the coordinators (requests sent, sum and max of the depth)
+	double busy[2] = {0, 0};
+	double elapsed = 0;
+	std::vector<long> sent(numP), depth_sum(numP), max_depth(numP);
+
+	// of the coordinators: requests, request messages, result messages and
+	// counts exchanged, then the sum and the max of the latencies
+	uint64_t traffic[4] = {0, 0, 0, 0};
+	double latency[2] = {0, 0};
+
+	// seconds the stream waited for pending keys, and the pairs parked: in
+	// all, at most at once, at most on a key
+	double stalled = 0;
+	uint64_t parking[3] = {0, 0, 0};
+
+	// the ranks 0 .. coordinators - 1 share the keys in ranges, the others
+	// are the workers
+	auto coordinator = [&](long key) { return static_cast<int>(key * coordinators / nkeys); };
+
+	// final phase, on every process: the coordinators share the counts and
+	// the values of the stream, every key is owned by a worker, which adds the
+	// results of all the pairs with the key in the order the master used to
+	// send them (for the key k and the other keys m: (m, k) for m < k, (k, m)
+	// for every m, (m, k) for m > k), and the values come back to rank 0
+	// with sums in which the other processes add -0, so V is bitwise the same
+	auto all_pairs = [&](std::vector<kernels::Check>& checks)
+	{
+		std::vector<long> counts(nkeys, 0);
+		std::vector<float> stream(nkeys, -0.0f);
+		for (long k = 0; myrank < coordinators && k < nkeys; ++k)
+			if (coordinator(k) == myrank)
+			{
+				counts[k] = map[k];
+				stream[k] = V[k];
+			}
+		MPI_Allreduce(MPI_IN_PLACE, counts.data(), nkeys, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce(MPI_IN_PLACE, stream.data(), nkeys, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+
+		// the keys without pairs keep the value of the stream, from rank 0
+		std::vector<float> mine(nkeys, -0.0f);
+		for (long k = 0; myrank == 0 && k < nkeys; ++k)
+			if (counts[k] == 0)
+				mine[k] = stream[k];
+		std::vector<long> owned;
+		for (long k = myrank - coordinators; myrank >= coordinators && k < nkeys; k += numP - coordinators)
+			if (counts[k] > 0)
+				owned.push_back(k);
+		const long active = std::count_if(counts.begin(), counts.end(), [](long c) { return c > 0; });
+
+		double t0 = MPI_Wtime();
+		{
+			profile::Region region;
+			#pragma omp parallel for schedule(dynamic)
+			for (size_t o = 0; o < owned.size(); ++o)
+			{
+				const long k = owned[o];
+				thread_local std::vector<float> results;
+				results.resize(nkeys);
+				auto& check = checks[omp_get_thread_num()];
+				for (long m = 0; m < nkeys; ++m)
+					if (m != k && counts[m] > 0)
+						results[m] = kernels::evaluate(mode, counts[k], counts[m], k, m, check);
+
+				float v = stream[k];
+				for (long m = 0; m < k; ++m)
+					if (counts[m] > 0)
+						v += results[m];
+				for (long m = 0; m < nkeys; ++m)
+					if (m != k && counts[m] > 0)
+						v += results[m];
+				for (long m = k + 1; m < nkeys; ++m)
+					if (counts[m] > 0)
+						v += results[m];
+				mine[k] = v;
+			}
+		}
+		busy[0] += owned.size() * (active - 1);
+		busy[1] += MPI_Wtime() - t0;
+
+		MPI_Reduce(mine.data(), V.data(), nkeys, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+	};
+
 	// just to make sure that all processes start at the same time
 	MPI_Barrier(MPI_COMM_WORLD);
 
-	if (myrank == 0)
+	if (myrank < coordinators)
 	{
-		// variable to distribute the keys between the processes
-		int round = 0;
+		// a coordinator runs the stream for its keys: every coordinator
+		// generates the whole stream and skips the elements without its keys;
+		// for an element with a key of another coordinator, the two
+		// coordinators exchange the counts of their keys after the increment,
+		// which is all the other key's state the element needs. The elements
+		// shared by two coordinators are seen by both in stream order, so the
+		// counts travel in order and the exchange cannot deadlock: the
+		// coordinator behind in the stream is never waiting for the other one
+
+		// the requests go to the workers with free credits
+		schedule::Credits scheduler(coordinators, numP, credits);
+
+		// results known by the master: a hit is applied once the current
+		// element is done, which is when the result of a request sent for
+		// it could arrive at the earliest, so the stream sees the same values
+		memo::Cache cache(master_cache_size);
+		std::vector<memo::Key> requested(nkeys);
+		std::vector<Result> answered;
+
+		// with park > 0 a pair with a pending key, or with a key of a pair
+		// already parked, waits in the queues of both its keys while the
+		// stream goes on; a pair is replayed when it is first in both queues
+		// and both keys are free, so every key still sees its pairs, its
+		// requests and its results in the order of the stream
+		struct Parked
+		{
+			long seq, key1, key2;
+		};
+		std::vector<std::deque<Parked>> parked(park > 0 ? nkeys : 0);
+		std::vector<long> freed;    // keys whose queue may be able to move
+		uint64_t parked_now = 0;
+
+		// applies the result of the request of key
+		auto apply = [&](long key, float r1)
+		{
+			V[key] += r1;
+			pending[key] = false;
+			if (park > 0)
+				freed.push_back(key);
+			// reset
+			auto _r1 = static_cast<unsigned long>(r1) % SIZE;
+			map[key] = (_r1 > (SIZE / 2)) ? 0 : _r1;
+		};
+
+		// the requests leave through a pool of non-blocking sends, the results
+		// arrive in receives posted in advance
+		comm::Sends<long> sends(MPI_LONG);
+		comm::Receives<Result> results(RESULT_T, batch, 2, std::max<long>(16, 2 * (numP - coordinators)));
+		long outstanding = 0;
+
+		// the requests of a worker leave together, up to batch of them, and
+		// the worker answers a batch with one message; a batch still open is
+		// sent before the master waits, and after flush_us in any case
+		comm::Batches<long> batches(sends, numP, batch, 4, 1, flush_us * 1e-6);
+
+		// from the request to its result, when the stream asked for a key
+		std::vector<double> issued(nkeys);
+		auto measure = [&](double since)
+		{
+			double t = MPI_Wtime() - since;
+			latency[0] += t;
+			latency[1] = std::max(latency[1], t);
+			++traffic[0];
+		};
+
+		auto on_result = [&](int source, const Result* result, int n)
+		{
+			++traffic[2];
+			for (int i = 0; i < n; ++i)
+			{
+				--outstanding;
+				scheduler.returned(source);
+				measure(issued[result[i].key]);
+				cache.insert(requested[result[i].key], result[i].r);
+				apply(result[i].key, result[i].r);
+			}
+		};
+
+		// the results arrived so far, or at least one when wait is true
+		auto progress = [&](bool wait)
+		{
+			if (wait)
+				batches.flush_all();
+			else if (batch > 1)
+				batches.flush_old(MPI_Wtime());
+			if (outstanding > 0)
+				results.poll(wait, on_result);
+		};
+
+		auto send = [&](long c1, long c2, long k1, long k2)
+		{
+			int computing_P;
+			while ((computing_P = scheduler.pick()) == 0)
+				progress(true);
+			long data[4] = {c1, c2, k1, k2};
+			double now = MPI_Wtime();
+			batches.add(data, computing_P, now);
+			scheduler.sent(computing_P);
+			++outstanding;
+			issued[k1] = now;
+		};
+
+		// sends the request to a computing process, unless the master knows its result
+		auto request = [&](long c1, long c2, long k1, long k2)
+		{
+			memo::Key key{c1, c2, k1, k2};
+			float r;
+			if (cache.find(key, r))
+			{
+				answered.push_back({k1, r});
+				return;
+			}
+			send(c1, c2, k1, k2);
+			pending[k1] = true;
+			requested[k1] = key;
+		};
+
+		// sends the count of a key to the coordinator of the other key of the
+		// element, and gets the count of that key
+		auto exchange = [&](int peer, long count)
+		{
+			sends.send(&count, 1, peer, 3);
+			long other;
+			MPI_Recv(&other, 1, MPI_LONG, peer, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			++traffic[3];
+			return other;
+		};
+
+		// an element of the stream whose keys are free
+		auto process = [&](long key1, long key2)
+		{
+			const bool mine1 = coordinator(key1) == myrank;
+			const bool mine2 = coordinator(key2) == myrank;
+
+			if (mine1)
+				map[key1]++; // count the number of key1 keys
+			if (mine2)
+				map[key2]++; // count the number of key2 keys
+			const long count1 = mine1 ? map[key1] : exchange(coordinator(key1), map[key2]);
+			const long count2 = mine2 ? map[key2] : exchange(coordinator(key2), map[key1]);
+
+			// if key1 reaches the SIZE limit, send a request to a process to compute the result
+			if (mine1 && count1 == SIZE && count2 != 0)
+				request(count1, count2, key1, key2);
+			// if key2 reaches the SIZE limit, send a request to a process to compute the result
+			if (mine2 && count2 == SIZE && count1 != 0)
+				request(count2, count1, key2, key1);
+
+			for (const auto& result : answered)
+				apply(result.key, result.r);
+			answered.clear();
+		};
+
+		// replays the parked pairs that can go now
+		auto replay = [&]()
+		{
+			while (!freed.empty())
+			{
+				const long key = freed.back();
+				freed.pop_back();
+				if (parked[key].empty() || pending[key])
+					continue;
+				const Parked first = parked[key].front();
+				const long other = (first.key1 == key) ? first.key2 : first.key1;
+				if (pending[other] || parked[other].front().seq != first.seq)
+					continue;
+				parked[key].pop_front();
+				parked[other].pop_front();
+				--parked_now;
+				process(first.key1, first.key2);
+				freed.push_back(first.key1);
+				freed.push_back(first.key2);
+			}
+		};
+
+		// waits for at least one result
+		auto stall = [&]()
+		{
+			double t0 = MPI_Wtime();
+			progress(true);
+			stalled += MPI_Wtime() - t0;
+		};
+
+		// the pairs of the generator or of the trace
+		trace::Source stream(nkeys);
+		if (!trace_path.empty() && !stream.open(trace_path))
+			MPI_Abort(MPI_COMM_WORLD, -1);
 
 		// start the timer
 		double start = MPI_Wtime();
 
-		for (int i = 0; i < length; ++i)
+		long i = 0;
+		for (; i < length && stream.next(key1, key2); ++i) // values in [0,nkeys[
 		{
-			key1 = random(0, nkeys - 1); // value in [0,nkeys[
-			key2 = random(0, nkeys - 1); // value in [0,nkeys[
 
 			if (key1 == key2) // only distinct values in the pair
 				key1 = (key1 + 1) % nkeys;
 
-			// check if key1 has a pending request
-			while (pending[key1] || pending[key2])
+			const bool mine1 = coordinator(key1) == myrank;
+			const bool mine2 = coordinator(key2) == myrank;
+			if (!mine1 && !mine2)
+				continue;
+
+			// apply the results already arrived
+			progress(false);
+
+			if (park == 0)
 			{
-				// collect available results
-				Result result;
-				MPI_Recv(&result, 1, RESULT_T, MPI_ANY_SOURCE, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-				float r1 = result.r;
-				V[result.key] += r1;
-				pending[result.key] = false;
-				// reset
-				auto _r1 = static_cast<unsigned long>(r1) % SIZE;
-				map[result.key] = (_r1 > (SIZE / 2)) ? 0 : _r1;
+				// wait only if one of the keys is still pending
+				while ((mine1 && pending[key1]) || (mine2 && pending[key2]))
+					stall();
+				process(key1, key2);
+				continue;
 			}
 
-			map[key1]++; // count the number of key1 keys
-			map[key2]++; // count the number of key2 keys
-
-			// if key1 reaches the SIZE limit, send a request to a process to compute the result
-			if (map[key1] == SIZE && map[key2] != 0)
+			replay();
+			if (!pending[key1] && !pending[key2] && parked[key1].empty() && parked[key2].empty())
 			{
-				// send the request to the computing process
-				int computing_P = ((++round) % (numP - 1)) + 1;
-				long data[4] = {map[key1], map[key2], key1, key2};
-				MPI_Send(&data, 4, MPI_LONG, computing_P, 1, MPI_COMM_WORLD);
-				pending[key1] = true;
+				process(key1, key2);
+				replay();
+				continue;
 			}
-			// if key2 reaches the SIZE limit, send a request to a process to compute the result
-			if (map[key2] == SIZE && map[key1] != 0)
+			parked[key1].push_back({i, key1, key2});
+			parked[key2].push_back({i, key1, key2});
+			++parked_now;
+			++parking[0];
+			parking[1] = std::max(parking[1], parked_now);
+			parking[2] = std::max<uint64_t>(parking[2], std::max(parked[key1].size(), parked[key2].size()));
+			while (parked_now > static_cast<uint64_t>(park))
 			{
-				// send the request to the computing process
-				int computing_P = ((++round) % (numP - 1)) + 1;
-				long data[4] = {map[key2], map[key1], key2, key1};
-				MPI_Send(&data, 4, MPI_LONG, computing_P, 1, MPI_COMM_WORLD);
-				pending[key2] = true;
+				stall();
+				replay();
 			}
 		}
 
-		// reset the pending requests
-		for (long i = 0; i < nkeys; ++i)
+		// a trace may end first
+		if (stream.failed())
+			MPI_Abort(MPI_COMM_WORLD, -1);
+		length = i;
+
+		// reset the pending requests, replaying the pairs still parked
+		while (outstanding > 0 || parked_now > 0)
 		{
-			while (pending[i])
-			{
-				Result result;
-				MPI_Recv(&result, 1, RESULT_T, MPI_ANY_SOURCE, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-				float r1 = result.r;
-				V[result.key] += r1;
-				pending[result.key] = false;
-				// reset
-				auto _r1 = static_cast<unsigned long>(r1) % SIZE;
-				map[result.key] = (_r1 > (SIZE / 2)) ? 0 : _r1;
-			}
+			progress(true);
+			if (park > 0)
+				replay();
 		}
 
-		round = 0;
-		// compute the last values
-		for (long i = 0; i < nkeys; ++i)
+		// terminate the workers, then the final phase
+		for (int p = coordinators; p < numP; p++)
+			sends.send(nullptr, 0, p, 1);
+		sends.wait_all();
+		results.cancel();
+		std::vector<kernels::Check> none(omp_get_max_threads());
+		all_pairs(none);
+
+		// stop the timer
+		double end = MPI_Wtime();
+		elapsed = end - start;
+		sent = scheduler.requests;
+		depth_sum = scheduler.depth_sum;
+		max_depth = scheduler.max_depth;
+		traffic[1] = batches.messages;
+
+		master_stats[0] = cache.lookups;
+		master_stats[1] = cache.hits;
+		master_stats[2] = cache.evictions;
+	}
+	else
+	{
+		// computing process: the batches arrived while the previous ones were
+		// computed are computed together by the threads, an empty request
+		// ends the process
+		omp_set_num_threads(threads);
+		std::vector<kernels::Check> checks(threads);
+		memo::Cache cache(cache_size);
+		comm::Sends<Result> sends(RESULT_T);
+		comm::Receives<long> requests(MPI_LONG, 4 * batch, 1, coordinators * (credits + 1));
+		std::vector<long> work;
+		std::vector<int> sizes;     // requests of every batch
+		std::vector<int> sources;   // and its coordinator
+		std::vector<Result> answers;
+		std::vector<char> known;
+
+		for (long running = coordinators; running > 0;)
 		{
-			for (long j = 0; j < nkeys; ++j)
+			work.clear();
+			sizes.clear();
+			sources.clear();
+			requests.poll(true, [&](int source, const long* data, int n)
 			{
-				if (i == j) continue;
-				if (map[i] > 0 && map[j] > 0)
+				if (n == 0)
+					--running;
+				else
 				{
-					// send the request to the computing process
-					int computing_P = ((++round) % (numP - 1)) + 1;
-					long data1[4] = {map[i], map[j], i, j};
-					MPI_Send(data1, 4, MPI_LONG, computing_P, 1, MPI_COMM_WORLD);
-
-					// send the request to the computing process
-					computing_P = ((++round) % (numP - 1)) + 1;
-					long data2[4] = {map[j], map[i], j, i};
-					MPI_Send(data2, 4, MPI_LONG, computing_P, 1, MPI_COMM_WORLD);
+					work.insert(work.end(), data, data + n);
+					sizes.push_back(n / 4);
+					sources.push_back(source);
 				}
+			});
+
+			// the cache is asked by the main thread, the threads compute the rest
+			const long count = work.size() / 4;
+			answers.resize(count);
+			known.assign(count, 0);
+			for (long i = 0; i < count; ++i)
+			{
+				const long* q = &work[4 * i];
+				answers[i].key = q[2];
+				known[i] = cache.find({q[0], q[1], q[2], q[3]}, answers[i].r);
 			}
-		}
 
-		round = 0;
-		// wait for the pending requests
-		for (long i = 0; i < nkeys; ++i)
-		{
-			for (long j = 0; j < nkeys; ++j)
+			double t0 = MPI_Wtime();
 			{
-				if (i == j) continue;
-				if (map[i] > 0 && map[j] > 0)
+				profile::Region region;
+				#pragma omp parallel for schedule(dynamic)
+				for (long i = 0; i < count; ++i)
 				{
-					int computing_P = ((++round) % (numP - 1)) + 1;
-					Result result;
-					MPI_Recv(&result, 1, RESULT_T, computing_P, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-					V[result.key] += result.r;
-
-					computing_P = ((++round) % (numP - 1)) + 1;
-					MPI_Recv(&result, 1, RESULT_T, computing_P, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-					V[result.key] += result.r;
+					if (known[i])
+						continue;
+					const long* q = &work[4 * i];
+					answers[i].r = kernels::evaluate(mode, q[0], q[1], q[2], q[3], checks[omp_get_thread_num()]);
 				}
 			}
-		}
+			busy[0] += count;
+			busy[1] += MPI_Wtime() - t0;
 
-		// stop the timer
-		double end = MPI_Wtime();
-
-		// terminate the other processes
-		for (int p = 1; p < numP; p++)
-			MPI_Send(NULL, 0, MPI_INT, p, 9, MPI_COMM_WORLD);
+			// every batch gets its results, in the order of the requests
+			long first = 0;
+			for (size_t b = 0; b < sizes.size(); ++b)
+			{
+				const long n = sizes[b];
+				for (long i = first; i < first + n; ++i)
+					if (!known[i])
+						cache.insert({work[4 * i], work[4 * i + 1], work[4 * i + 2], work[4 * i + 3]}, answers[i].r);
+				sends.send(&answers[first], n, sources[b], 2);
+				first += n;
+			}
+		}
+		sends.wait_all();
+		requests.cancel();
+		all_pairs(checks);
+
+		kernels::Check check;
+		for (const auto& c : checks)
+			check.merge(c);
+
+		if (mode == kernels::Mode::verify)
+			std::printf("Verified on rank %d: %lu requests; product: %lu not equal to the reference, worst error %.3g of the tolerance;"
+						" closed form: %lu out of tolerance, worst error %.3g of the tolerance\n",
+						myrank, check.checked, check.gemm.failed, check.gemm.worst, check.fused.failed, check.fused.worst);
+
+		worker_stats[0] = cache.lookups;
+		worker_stats[1] = cache.hits;
+		worker_stats[2] = cache.evictions;
+	}
 
-		// print the elapsed time
-		std::printf("Elapsed time: %f, with %d proc, keys= %ld, length=%ld\n", end - start, numP, nkeys, length);
+	// print the elapsed time, the traffic of the coordinators and the results
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : traffic, traffic, 4, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : &latency[0], &latency[0], 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : &latency[1], &latency[1], 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : &stalled, &stalled, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (myrank == 0)
+	{
+		std::printf("Elapsed time: %f, with %d proc, keys= %ld, length=%ld\n", elapsed, numP, nkeys, length);
+		std::printf("Requests: %lu in %lu messages, %lu result messages, %.0f requests/s, latency avg %.1f us max %.1f us\n",
+					traffic[0], traffic[1], traffic[2], elapsed > 0 ? traffic[0] / elapsed : 0.0,
+					traffic[0] ? 1e6 * latency[0] / traffic[0] : 0.0, 1e6 * latency[1]);
+		if (coordinators > 1)
+			std::printf("Coordinators: %ld, %lu counts exchanged\n", coordinators, traffic[3]);
+		std::printf("Stalls: %f s waiting for pending keys", stalled);
+		if (park > 0)
+			std::printf(", %lu pairs parked, at most %lu at once and %lu on a key", parking[0], parking[1], parking[2]);
+		std::printf("\n");
 
 		// printing the results
 		if (print)
@@ -250,41 +613,35 @@ int main(int argc, char *argv[])
 				std::printf("key %ld : %f\n", i, V[i]);
 		}
 	}
-	else
+
+	// hit rates of the caches: the master hits avoid the message and the
+	// product, the worker hits only the product
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : master_stats, master_stats, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : worker_stats, worker_stats, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (myrank == 0)
 	{
-		// computing process
-		MPI_Status status;
-		long data[4];
+		auto rate = [](const uint64_t* stats) { return stats[0] ? 100.0 * stats[1] / stats[0] : 0.0; };
+		if (master_cache_size > 0)
+			std::printf("Master cache: %lu hits of %lu requests (%.1f%%), %lu evictions\n",
+						master_stats[1], master_stats[0], rate(master_stats), master_stats[2]);
+		if (cache_size > 0)
+			std::printf("Worker cache: %lu hits of %lu requests (%.1f%%), %lu evictions\n",
+						worker_stats[1], worker_stats[0], rate(worker_stats), worker_stats[2]);
+	}
 
-		while (true)
-		{
-			MPI_Recv(&data, 4, MPI_LONG, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-			if (status.MPI_TAG == 9)
-			{
-				break;
-			}
-			long c1 = data[0];
-			long c2 = data[1];
-			long key1 = data[2];
-			long key2 = data[3];
-
-			float r = compute(c1, c2, key1, key2);
-
-			// send the result
-			Result result;
-			result.key = key1;
-			result.r = r;
-			MPI_Send(&result, 1, RESULT_T, 0, 2, MPI_COMM_WORLD);
-
-			/*
-			MPI_Request request;
-			Result *result = new Result;
-			result->key = key1;
-			result->r = r;
-			MPI_Isend(result, 1, RESULT_T, 0, 2, MPI_COMM_WORLD, &request);
-			MPI_Request_free(&request);
-			*/
-		}
+	// how busy the workers were and how many requests waited for them
+	std::vector<double> load(2 * numP);
+	MPI_Gather(busy, 2, MPI_DOUBLE, load.data(), 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : sent.data(), sent.data(), numP, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : depth_sum.data(), depth_sum.data(), numP, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : max_depth.data(), max_depth.data(), numP, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (myrank == 0)
+	{
+		std::printf("%6s %10s %10s %12s %10s %10s\n", "worker", "requests", "busy (s)", "utilization", "avg depth", "max depth");
+		for (int p = coordinators; p < numP; ++p)
+			std::printf("%6d %10.0f %10.4f %11.1f%% %10.2f %10ld\n", p, load[2 * p], load[2 * p + 1],
+						elapsed > 0 ? 100.0 * load[2 * p + 1] / elapsed : 0.0,
+						sent[p] ? static_cast<double>(depth_sum[p]) / sent[p] : 0.0, max_depth[p]);
 	}
 
 	MPI_Type_free(&RESULT_T);
@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <trace.hpp>
+// g++ -std=c++20 -O3 -I include/ -o nkeystrace nkeystrace.cpp   (or make nkeystrace)
+// ./nkeystrace 100 1000000 stream.trace
+// mpirun -n 4 ./nkeyspar --trace stream.trace 100 1000000
+
+// Writes the stream of nkeyspar, the pairs of the generator, as a trace
+// (include/trace.hpp) to a file or to the standard output ("-").
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4)
+	{
+		std::printf("use: %s nkeys length file|-\n", argv[0]);
+		return -1;
+	}
+	long nkeys = std::stol(argv[1]);
+	long length = std::stol(argv[2]);
+	std::string path = argv[3];
+	if (nkeys < 2 || nkeys > static_cast<long>(UINT32_MAX) + 1 || length < 0)
+	{
+		std::printf("ERROR: the keys must be between 2 and 2^32, the length not negative\n");
+		return -1;
+	}
+
+	FILE *out = (path == "-") ? stdout : std::fopen(path.c_str(), "wb");
+	if (!out)
+	{
+		std::printf("ERROR: opening file %s\n", path.c_str());
+		return -1;
+	}
+
+	trace::Header header;
+	std::memcpy(header.magic, trace::MAGIC, sizeof(trace::MAGIC));
+	header.nkeys = nkeys;
+	header.length = length;
+	bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+
+	// the pairs leave in blocks
+	trace::Generator generator;
+	std::vector<uint32_t> block;
+	for (long i = 0; ok && i < length; ++i)
+	{
+		block.push_back(generator(0, nkeys - 1));
+		block.push_back(generator(0, nkeys - 1));
+		if (block.size() == (2 << 16) || i == length - 1)
+		{
+			ok = std::fwrite(block.data(), sizeof(uint32_t), block.size(), out) == block.size();
+			block.clear();
+		}
+	}
+	if (out != stdout)
+		ok = (std::fclose(out) == 0) && ok;
+	else
+		ok = (std::fflush(out) == 0) && ok;
+	if (!ok)
+	{
+		std::fprintf(stderr, "ERROR: writing the trace\n");
+		return -1;
+	}
+	return 0;
+}